@@ -0,0 +1,687 @@
+#define _GNU_SOURCE // fallocate, O_DIRECT
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "fs.h"
+#include "disk.h"
+
+// Buffers freed back to the pool beyond this many are returned to malloc, so
+// the pool holds at most BDEV_POOL_KEEP * BDEV_BUF_BLOCKS blocks when idle
+#define BDEV_POOL_KEEP 8
+
+static void *poolFree[BDEV_POOL_KEEP];
+static int poolCount = 0;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+void *bdev_buf_get(void) {
+    void *buf = NULL;
+    pthread_mutex_lock(&poolLock);
+    if (poolCount > 0) buf = poolFree[--poolCount];
+    pthread_mutex_unlock(&poolLock);
+    if (!buf && posix_memalign(&buf, BDEV_BUF_ALIGN, (size_t)BDEV_BUF_BLOCKS * BLOCK_SIZE) != 0) return NULL;
+    return buf;
+}
+
+void bdev_buf_put(void *buf) {
+    if (!buf) return;
+    pthread_mutex_lock(&poolLock);
+    if (poolCount < BDEV_POOL_KEEP) {
+        poolFree[poolCount++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&poolLock);
+    free(buf);
+}
+
+// Image file backend
+typedef struct {
+    BlockDevice base;
+    int fd;
+} FileDevice;
+
+static int fileRead(BlockDevice *dev, int first_block, int count, void *buf) {
+    FileDevice *fdev = (FileDevice *)dev;
+    if (first_block < 0 || first_block + count > dev->num_blocks) return -1;
+
+    size_t len = (size_t)count * BLOCK_SIZE;
+    off_t off = (off_t)first_block * BLOCK_SIZE;
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fdev->fd, p, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int fileWrite(BlockDevice *dev, int first_block, int count, const void *buf) {
+    FileDevice *fdev = (FileDevice *)dev;
+    if (first_block < 0 || first_block + count > dev->num_blocks) return -1;
+
+    size_t len = (size_t)count * BLOCK_SIZE;
+    off_t off = (off_t)first_block * BLOCK_SIZE;
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fdev->fd, p, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static size_t iovecLength(const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    return total;
+}
+
+static int inRange(BlockDevice *dev, int first_block, size_t len) {
+    return first_block >= 0 &&
+           (size_t)first_block * BLOCK_SIZE + len <= (size_t)dev->num_blocks * BLOCK_SIZE;
+}
+
+// preadv/pwritev may transfer less than asked for, so continue from wherever
+// they stopped until the whole vector is done
+static int fileVector(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt, int write) {
+    FileDevice *fdev = (FileDevice *)dev;
+    size_t len = iovecLength(iov, iovcnt);
+    if (!inRange(dev, first_block, len)) return -1;
+
+    struct iovec local[BDEV_IOV_MAX];
+    if (iovcnt > BDEV_IOV_MAX) return -1;
+    memcpy(local, iov, iovcnt * sizeof(struct iovec));
+
+    struct iovec *cur = local;
+    off_t off = (off_t)first_block * BLOCK_SIZE;
+    while (len > 0) {
+        ssize_t n = write ? pwritev(fdev->fd, cur, iovcnt, off) : preadv(fdev->fd, cur, iovcnt, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        off += n;
+        len -= n;
+        while (iovcnt > 0 && (size_t)n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            cur->iov_base = (char *)cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int fileReadv(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt) {
+    return fileVector(dev, first_block, iov, iovcnt, 0);
+}
+
+static int fileWritev(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt) {
+    return fileVector(dev, first_block, iov, iovcnt, 1);
+}
+
+static int fileSync(BlockDevice *dev) {
+    return fdatasync(((FileDevice *)dev)->fd) == 0 ? 0 : -1;
+}
+
+// Punches a hole over the blocks, keeping the image size unchanged
+static int fileDiscard(BlockDevice *dev, int first_block, int count) {
+    if (first_block < 0 || first_block + count > dev->num_blocks) return -1;
+    int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+    return fallocate(((FileDevice *)dev)->fd, mode, (off_t)first_block * BLOCK_SIZE,
+                     (off_t)count * BLOCK_SIZE) == 0 ? 0 : -1;
+}
+
+static void fileClose(BlockDevice *dev) {
+    close(((FileDevice *)dev)->fd);
+    free(dev);
+}
+
+static void initFile(FileDevice *fdev, int fd, off_t size) {
+    fdev->fd = fd;
+    fdev->base.read = fileRead;
+    fdev->base.write = fileWrite;
+    fdev->base.readv = fileReadv;
+    fdev->base.writev = fileWritev;
+    fdev->base.sync = fileSync;
+    fdev->base.discard = fileDiscard;
+    fdev->base.close = fileClose;
+    fdev->base.num_blocks = (int)(size / BLOCK_SIZE);
+}
+
+// With create_blocks > 0 the file is created or truncated to that many blocks
+static BlockDevice *openFile(const char *path, int writable, int create_blocks) {
+    int flags = writable ? O_RDWR : O_RDONLY;
+    if (create_blocks > 0) flags = O_RDWR | O_CREAT | O_TRUNC;
+
+    int fd = open(path, flags, 0644);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (create_blocks > 0 && ftruncate(fd, (off_t)create_blocks * BLOCK_SIZE) != 0) {
+        close(fd);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < BLOCK_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    FileDevice *fdev = calloc(1, sizeof(FileDevice));
+    if (!fdev) {
+        close(fd);
+        return NULL;
+    }
+    initFile(fdev, fd, st.st_size);
+    return &fdev->base;
+}
+
+BlockDevice *bdev_open_file(const char *path, int writable, int create) {
+    return openFile(path, writable, create ? NUM_BLOCKS + (int)GEN_BLOCKS : 0);
+}
+
+// Direct I/O backend. Transfers whose buffers meet the alignment go to the
+// file backend's operations unchanged, the rest are bounced through pool
+// buffers one BDEV_BUF_BLOCKS chunk at a time.
+typedef struct {
+    FileDevice file;
+    size_t align; // Buffer, offset and length alignment the file needs
+} DirectDevice;
+
+static int isAligned(const void *p, size_t align) {
+    return (uintptr_t)p % align == 0;
+}
+
+static int directBounce(BlockDevice *dev, int first_block, int count, char *p, int write) {
+    char *bounce = bdev_buf_get();
+    if (!bounce) return -1;
+    int rc = 0;
+    while (rc == 0 && count > 0) {
+        int n = count < BDEV_BUF_BLOCKS ? count : BDEV_BUF_BLOCKS;
+        size_t bytes = (size_t)n * BLOCK_SIZE;
+        if (write) {
+            memcpy(bounce, p, bytes);
+            rc = fileWrite(dev, first_block, n, bounce);
+        } else {
+            rc = fileRead(dev, first_block, n, bounce);
+            if (rc == 0) memcpy(p, bounce, bytes);
+        }
+        first_block += n;
+        count -= n;
+        p += bytes;
+    }
+    bdev_buf_put(bounce);
+    return rc;
+}
+
+static int directRead(BlockDevice *dev, int first_block, int count, void *buf) {
+    if (first_block < 0 || first_block + count > dev->num_blocks) return -1;
+    if (isAligned(buf, ((DirectDevice *)dev)->align)) return fileRead(dev, first_block, count, buf);
+    return directBounce(dev, first_block, count, buf, 0);
+}
+
+static int directWrite(BlockDevice *dev, int first_block, int count, const void *buf) {
+    if (first_block < 0 || first_block + count > dev->num_blocks) return -1;
+    if (isAligned(buf, ((DirectDevice *)dev)->align)) return fileWrite(dev, first_block, count, buf);
+    return directBounce(dev, first_block, count, (char *)buf, 1);
+}
+
+// Copies len bytes between a flat buffer and the vector, continuing from the
+// piece and offset an earlier call stopped at
+static void iovecCopy(const struct iovec *iov, int *piece, size_t *off, char *flat, size_t len, int toIovec) {
+    while (len > 0) {
+        size_t n = iov[*piece].iov_len - *off;
+        if (n > len) n = len;
+        char *p = (char *)iov[*piece].iov_base + *off;
+        if (toIovec) memcpy(p, flat, n);
+        else memcpy(flat, p, n);
+        flat += n;
+        len -= n;
+        *off += n;
+        if (*off == iov[*piece].iov_len) {
+            (*piece)++;
+            *off = 0;
+        }
+    }
+}
+
+// Vectors of aligned whole blocks go out as one preadv or pwritev. Others are
+// gathered into pool buffers, and a partial last block is read first so the
+// bytes past the vector keep their contents.
+static int directVector(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt, int write) {
+    size_t align = ((DirectDevice *)dev)->align;
+    size_t len = iovecLength(iov, iovcnt);
+    if (!inRange(dev, first_block, len)) return -1;
+
+    int aligned = 1;
+    for (int i = 0; aligned && i < iovcnt; i++) {
+        aligned = isAligned(iov[i].iov_base, align) && iov[i].iov_len % BLOCK_SIZE == 0;
+    }
+    if (aligned) return fileVector(dev, first_block, iov, iovcnt, write);
+
+    char *bounce = bdev_buf_get();
+    if (!bounce) return -1;
+    int piece = 0;
+    size_t off = 0;
+    int rc = 0;
+    while (rc == 0 && len > 0) {
+        size_t chunk = (size_t)BDEV_BUF_BLOCKS * BLOCK_SIZE;
+        size_t bytes = len < chunk ? len : chunk;
+        int n = (int)((bytes + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        if (write) {
+            if (bytes % BLOCK_SIZE != 0) {
+                rc = fileRead(dev, first_block + n - 1, 1, bounce + (size_t)(n - 1) * BLOCK_SIZE);
+            }
+            iovecCopy(iov, &piece, &off, bounce, bytes, 0);
+            if (rc == 0) rc = fileWrite(dev, first_block, n, bounce);
+        } else {
+            rc = fileRead(dev, first_block, n, bounce);
+            if (rc == 0) iovecCopy(iov, &piece, &off, bounce, bytes, 1);
+        }
+        first_block += n;
+        len -= bytes;
+    }
+    bdev_buf_put(bounce);
+    return rc;
+}
+
+static int directReadv(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt) {
+    return directVector(dev, first_block, iov, iovcnt, 0);
+}
+
+static int directWritev(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt) {
+    return directVector(dev, first_block, iov, iovcnt, 1);
+}
+
+// Smallest power of two from 512 up to BLOCK_SIZE at which a direct read
+// succeeds, or 0 if none does. Reads at a finer alignment than the device's
+// logical sectors fail with EINVAL.
+static size_t probeAlignment(int fd) {
+    char *buf = bdev_buf_get();
+    if (!buf) return 0;
+    size_t found = 0;
+    for (size_t align = 512; !found && align <= BLOCK_SIZE && align <= BDEV_BUF_ALIGN; align *= 2) {
+        ssize_t n;
+        do {
+            n = pread(fd, buf + align, align, (off_t)align);
+        } while (n < 0 && errno == EINTR);
+        if (n == (ssize_t)align) found = align;
+    }
+    bdev_buf_put(buf);
+    return found;
+}
+
+BlockDevice *bdev_open_direct(const char *path, int writable) {
+    int fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_DIRECT);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    size_t align = 0;
+    if (fstat(fd, &st) == 0 && st.st_size >= 2 * BLOCK_SIZE) align = probeAlignment(fd);
+    DirectDevice *ddev = align ? calloc(1, sizeof(DirectDevice)) : NULL;
+    if (!ddev) {
+        close(fd);
+        return NULL;
+    }
+    initFile(&ddev->file, fd, st.st_size);
+    ddev->align = align;
+    ddev->file.base.read = directRead;
+    ddev->file.base.write = directWrite;
+    ddev->file.base.readv = directReadv;
+    ddev->file.base.writev = directWritev;
+    return &ddev->file.base;
+}
+
+// Striped backend. Stripe unit s, made of unit consecutive blocks, lives in
+// member s % count, where it follows the member's earlier units.
+typedef struct {
+    BlockDevice base;
+    int count;
+    int unit;
+    BlockDevice *members[STRIPE_MAX_FILES];
+} StripeDevice;
+
+// One member's share of a transfer. Its pieces are consecutive in the member
+// and split into batches that start on a block boundary and fit in one
+// vectored call.
+typedef struct {
+    BlockDevice *dev;
+    int write;
+    struct iovec *iov;
+    int iovcnt;
+    int *batchFirst; // Member block each batch starts at
+    int *batchStart; // Index of each batch's first piece
+    int batches;
+    int rc;
+} StripeJob;
+
+// Cuts a transfer at stripe unit boundaries and appends each piece to its
+// member's job. With fill unset the pieces and batches are only counted.
+static void stripeSplit(StripeDevice *sdev, int first_block, const struct iovec *iov, int iovcnt,
+                        StripeJob *jobs, int fill) {
+    size_t unitBytes = (size_t)sdev->unit * BLOCK_SIZE;
+    size_t pos = (size_t)first_block * BLOCK_SIZE;
+    for (int i = 0; i < iovcnt; i++) {
+        char *p = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            size_t inUnit = pos % unitBytes;
+            size_t n = unitBytes - inUnit < left ? unitBytes - inUnit : left;
+            size_t stripe = pos / unitBytes;
+            StripeJob *job = &jobs[stripe % sdev->count];
+
+            // A new unit may join the current batch while the batch could
+            // still take every piece of it
+            if (inUnit == 0 || job->iovcnt == 0) {
+                int current = fill && job->batches ? job->iovcnt - job->batchStart[job->batches - 1] : 0;
+                if (!fill || job->batches == 0 || current + iovcnt + 1 > BDEV_IOV_MAX) {
+                    if (fill) {
+                        job->batchFirst[job->batches] = (int)((stripe / sdev->count) * sdev->unit + inUnit / BLOCK_SIZE);
+                        job->batchStart[job->batches] = job->iovcnt;
+                    }
+                    job->batches++;
+                }
+            }
+            if (fill) {
+                job->iov[job->iovcnt].iov_base = p;
+                job->iov[job->iovcnt].iov_len = n;
+            }
+            job->iovcnt++;
+            p += n;
+            left -= n;
+            pos += n;
+        }
+    }
+}
+
+static void *stripeRun(void *arg) {
+    StripeJob *job = arg;
+    for (int k = 0; job->rc == 0 && k < job->batches; k++) {
+        int start = job->batchStart[k];
+        int end = k + 1 < job->batches ? job->batchStart[k + 1] : job->iovcnt;
+        job->rc = job->write ? job->dev->writev(job->dev, job->batchFirst[k], job->iov + start, end - start)
+                             : job->dev->readv(job->dev, job->batchFirst[k], job->iov + start, end - start);
+    }
+    return NULL;
+}
+
+// Transfers that stay inside one stripe unit go straight to its member.
+// Anything larger is split per member and the members run in parallel, one
+// thread each besides the caller's.
+static int stripeVector(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt, int write) {
+    StripeDevice *sdev = (StripeDevice *)dev;
+    size_t len = iovecLength(iov, iovcnt);
+    if (!inRange(dev, first_block, len)) return -1;
+    if (len == 0) return 0;
+
+    int unit = sdev->unit;
+    int lastBlock = first_block + (int)((len - 1) / BLOCK_SIZE);
+    if (first_block / unit == lastBlock / unit) {
+        int stripe = first_block / unit;
+        BlockDevice *member = sdev->members[stripe % sdev->count];
+        int memberBlock = (stripe / sdev->count) * unit + first_block % unit;
+        return write ? member->writev(member, memberBlock, iov, iovcnt)
+                     : member->readv(member, memberBlock, iov, iovcnt);
+    }
+
+    StripeJob jobs[STRIPE_MAX_FILES];
+    memset(jobs, 0, sizeof(jobs));
+    stripeSplit(sdev, first_block, iov, iovcnt, jobs, 0);
+
+    size_t pieces = 0;
+    size_t batches = 0;
+    for (int m = 0; m < sdev->count; m++) {
+        pieces += jobs[m].iovcnt;
+        batches += jobs[m].batches;
+    }
+    char *mem = malloc(pieces * sizeof(struct iovec) + 2 * batches * sizeof(int));
+    if (!mem) return -1;
+    struct iovec *nextIov = (struct iovec *)mem;
+    int *nextInt = (int *)(mem + pieces * sizeof(struct iovec));
+    for (int m = 0; m < sdev->count; m++) {
+        StripeJob *job = &jobs[m];
+        job->dev = sdev->members[m];
+        job->write = write;
+        job->iov = nextIov;
+        job->batchFirst = nextInt;
+        job->batchStart = nextInt + job->batches;
+        nextIov += job->iovcnt;
+        nextInt += 2 * job->batches;
+        job->iovcnt = job->batches = 0;
+    }
+    stripeSplit(sdev, first_block, iov, iovcnt, jobs, 1);
+
+    // The caller takes the first member with work, threads the rest
+    pthread_t threads[STRIPE_MAX_FILES];
+    int started[STRIPE_MAX_FILES] = {0};
+    int inlineMember = -1;
+    for (int m = 0; m < sdev->count; m++) {
+        if (jobs[m].iovcnt == 0) continue;
+        if (inlineMember == -1) inlineMember = m;
+        else started[m] = pthread_create(&threads[m], NULL, stripeRun, &jobs[m]) == 0;
+    }
+    for (int m = 0; m < sdev->count; m++) {
+        if (jobs[m].iovcnt > 0 && m != inlineMember && !started[m]) stripeRun(&jobs[m]);
+    }
+    stripeRun(&jobs[inlineMember]);
+
+    int rc = 0;
+    for (int m = 0; m < sdev->count; m++) {
+        if (started[m]) pthread_join(threads[m], NULL);
+        if (jobs[m].rc != 0) rc = -1;
+    }
+    free(mem);
+    return rc;
+}
+
+static int stripeRead(BlockDevice *dev, int first_block, int count, void *buf) {
+    struct iovec whole = { .iov_base = buf, .iov_len = (size_t)count * BLOCK_SIZE };
+    return stripeVector(dev, first_block, &whole, 1, 0);
+}
+
+static int stripeWrite(BlockDevice *dev, int first_block, int count, const void *buf) {
+    struct iovec whole = { .iov_base = (void *)buf, .iov_len = (size_t)count * BLOCK_SIZE };
+    return stripeVector(dev, first_block, &whole, 1, 1);
+}
+
+static int stripeReadv(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt) {
+    return stripeVector(dev, first_block, iov, iovcnt, 0);
+}
+
+static int stripeWritev(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt) {
+    return stripeVector(dev, first_block, iov, iovcnt, 1);
+}
+
+static int stripeSync(BlockDevice *dev) {
+    StripeDevice *sdev = (StripeDevice *)dev;
+    int rc = 0;
+    for (int m = 0; m < sdev->count; m++) {
+        if (sdev->members[m]->sync(sdev->members[m]) != 0) rc = -1;
+    }
+    return rc;
+}
+
+static int stripeDiscard(BlockDevice *dev, int first_block, int count) {
+    StripeDevice *sdev = (StripeDevice *)dev;
+    if (first_block < 0 || first_block + count > dev->num_blocks) return -1;
+    while (count > 0) {
+        int stripe = first_block / sdev->unit;
+        int n = sdev->unit - first_block % sdev->unit;
+        if (n > count) n = count;
+        BlockDevice *member = sdev->members[stripe % sdev->count];
+        int memberBlock = (stripe / sdev->count) * sdev->unit + first_block % sdev->unit;
+        if (member->discard(member, memberBlock, n) != 0) return -1;
+        first_block += n;
+        count -= n;
+    }
+    return 0;
+}
+
+static void stripeClose(BlockDevice *dev) {
+    StripeDevice *sdev = (StripeDevice *)dev;
+    for (int m = 0; m < sdev->count; m++) bdev_close(sdev->members[m]);
+    free(dev);
+}
+
+BlockDevice *bdev_open_stripe(const char *const *paths, int count, int unit, int writable, int create) {
+    if (count < 1 || count > STRIPE_MAX_FILES || unit < 1) return NULL;
+
+    StripeDevice *sdev = calloc(1, sizeof(StripeDevice));
+    if (!sdev) return NULL;
+    sdev->count = count;
+    sdev->unit = unit;
+
+    // Created members get just enough whole units to hold a full image
+    int units = (NUM_BLOCKS + (int)GEN_BLOCKS + unit - 1) / unit;
+    int memberBlocks = create ? (units + count - 1) / count * unit : 0;
+    int minUnits = -1;
+    for (int m = 0; m < count; m++) {
+        sdev->members[m] = openFile(paths[m], writable, memberBlocks);
+        if (!sdev->members[m]) {
+            stripeClose(&sdev->base);
+            return NULL;
+        }
+        int memberUnits = sdev->members[m]->num_blocks / unit;
+        if (minUnits == -1 || memberUnits < minUnits) minUnits = memberUnits;
+    }
+
+    sdev->base.read = stripeRead;
+    sdev->base.write = stripeWrite;
+    sdev->base.readv = stripeReadv;
+    sdev->base.writev = stripeWritev;
+    sdev->base.sync = stripeSync;
+    sdev->base.discard = stripeDiscard;
+    sdev->base.close = stripeClose;
+    sdev->base.num_blocks = minUnits * count * unit;
+    return &sdev->base;
+}
+
+// RAM disk backend
+typedef struct {
+    BlockDevice base;
+    char *data;
+} RamDevice;
+
+static int ramRead(BlockDevice *dev, int first_block, int count, void *buf) {
+    if (first_block < 0 || first_block + count > dev->num_blocks) return -1;
+    memcpy(buf, ((RamDevice *)dev)->data + (size_t)first_block * BLOCK_SIZE, (size_t)count * BLOCK_SIZE);
+    return 0;
+}
+
+static int ramWrite(BlockDevice *dev, int first_block, int count, const void *buf) {
+    if (first_block < 0 || first_block + count > dev->num_blocks) return -1;
+    memcpy(((RamDevice *)dev)->data + (size_t)first_block * BLOCK_SIZE, buf, (size_t)count * BLOCK_SIZE);
+    return 0;
+}
+
+static int ramReadv(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt) {
+    if (!inRange(dev, first_block, iovecLength(iov, iovcnt))) return -1;
+    const char *p = ((RamDevice *)dev)->data + (size_t)first_block * BLOCK_SIZE;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(iov[i].iov_base, p, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    return 0;
+}
+
+static int ramWritev(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt) {
+    if (!inRange(dev, first_block, iovecLength(iov, iovcnt))) return -1;
+    char *p = ((RamDevice *)dev)->data + (size_t)first_block * BLOCK_SIZE;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    return 0;
+}
+
+static int ramSync(BlockDevice *dev) {
+    (void)dev;
+    return 0;
+}
+
+static int ramDiscard(BlockDevice *dev, int first_block, int count) {
+    if (first_block < 0 || first_block + count > dev->num_blocks) return -1;
+    memset(((RamDevice *)dev)->data + (size_t)first_block * BLOCK_SIZE, 0, (size_t)count * BLOCK_SIZE);
+    return 0;
+}
+
+static void ramClose(BlockDevice *dev) {
+    free(((RamDevice *)dev)->data);
+    free(dev);
+}
+
+BlockDevice *bdev_open_ram(int num_blocks) {
+    RamDevice *rdev = calloc(1, sizeof(RamDevice));
+    if (!rdev) return NULL;
+    rdev->data = calloc(num_blocks, BLOCK_SIZE);
+    if (!rdev->data) {
+        free(rdev);
+        return NULL;
+    }
+    rdev->base.read = ramRead;
+    rdev->base.write = ramWrite;
+    rdev->base.readv = ramReadv;
+    rdev->base.writev = ramWritev;
+    rdev->base.sync = ramSync;
+    rdev->base.discard = ramDiscard;
+    rdev->base.close = ramClose;
+    rdev->base.num_blocks = num_blocks;
+    return &rdev->base;
+}
+
+BlockDevice *bdev_load_ram(const char *path) {
+    BlockDevice *file = bdev_open_file(path, 0, 0);
+    if (!file) return NULL;
+
+    BlockDevice *ram = bdev_open_ram(file->num_blocks);
+    if (ram && file->read(file, 0, file->num_blocks, ((RamDevice *)ram)->data) != 0) {
+        bdev_close(ram);
+        ram = NULL;
+    }
+    bdev_close(file);
+    return ram;
+}
+
+int bdev_save(BlockDevice *dev, const char *path) {
+    BlockDevice *file = bdev_open_file(path, 1, 1);
+    if (!file) return -1;
+
+    // Copy in chunks so any backend can be saved without knowing its layout.
+    // The new file starts out as one big hole, so all-zero chunks are skipped.
+    char *buf = bdev_buf_get();
+    int rc = buf ? 0 : -1;
+    for (int b = 0; rc == 0 && b < dev->num_blocks; b += BDEV_BUF_BLOCKS) {
+        int count = dev->num_blocks - b < BDEV_BUF_BLOCKS ? dev->num_blocks - b : BDEV_BUF_BLOCKS;
+        if (count > file->num_blocks - b) count = file->num_blocks - b;
+        if (count <= 0) break;
+        rc = dev->read(dev, b, count, buf);
+        if (rc == 0 && !bdev_is_zero(buf, (size_t)count * BLOCK_SIZE)) rc = file->write(file, b, count, buf);
+    }
+    if (rc == 0) rc = file->sync(file);
+    bdev_buf_put(buf);
+    bdev_close(file);
+    return rc;
+}
+
+int bdev_is_zero(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    if (len == 0) return 1;
+    // Every byte is zero if the first is and each byte equals the next
+    return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
+
+void bdev_close(BlockDevice *dev) {
+    if (dev) dev->close(dev);
+}
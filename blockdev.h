@@ -0,0 +1,65 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <sys/uio.h>
+
+#define BDEV_IOV_MAX 1024 // Most buffers one vectored transfer may take
+
+// Block device underneath readBlock and writeBlock. A backend fills in the
+// operations and embeds this struct as its first member.
+typedef struct BlockDevice {
+    // Transfer count consecutive blocks starting at first_block, 0 on success
+    int (*read)(struct BlockDevice *dev, int first_block, int count, void *buf);
+    int (*write)(struct BlockDevice *dev, int first_block, int count, const void *buf);
+    // Vectored transfers starting at the beginning of first_block and covering
+    // the concatenated buffers, which need not be a whole number of blocks
+    int (*readv)(struct BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt);
+    int (*writev)(struct BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt);
+    int (*sync)(struct BlockDevice *dev); // Make earlier writes durable
+    // Releases the storage behind count blocks, which then read as zeros
+    int (*discard)(struct BlockDevice *dev, int first_block, int count);
+    void (*close)(struct BlockDevice *dev);
+    int num_blocks;
+} BlockDevice;
+
+// Image file accessed with pread/pwrite. With create set the file is created
+// or truncated to a full image including the generation table, otherwise it
+// must already exist.
+BlockDevice *bdev_open_file(const char *path, int writable, int create);
+
+// Image file opened with O_DIRECT, bypassing the page cache so blocks are
+// cached once, by the mounted block cache. Buffers, offsets and lengths must
+// be aligned to the logical sector size of the disk under the file. Aligned
+// transfers go straight to the file, unaligned ones are bounced through the
+// buffer pool. Fails where the filesystem has no direct I/O or its sectors
+// are larger than BLOCK_SIZE.
+BlockDevice *bdev_open_direct(const char *path, int writable);
+
+// Volume striped over count image files, unit blocks to a file before moving
+// on to the next. Transfers spanning several files run on all of them at
+// once. With create set each file is created or truncated to its share of a
+// full image.
+#define STRIPE_MAX_FILES 16
+BlockDevice *bdev_open_stripe(const char *const *paths, int count, int unit, int writable, int create);
+
+// RAM disk, either empty or loaded from an image file
+BlockDevice *bdev_open_ram(int num_blocks);
+BlockDevice *bdev_load_ram(const char *path);
+
+// Copies the whole device to an image file, e.g. to persist a RAM disk.
+// Runs of zero blocks are left as holes in the file.
+int bdev_save(BlockDevice *dev, const char *path);
+
+// Pool of BDEV_BUF_BLOCKS-block buffers aligned for direct I/O, reused from
+// one transfer to the next instead of allocated each time
+#define BDEV_BUF_BLOCKS 64
+#define BDEV_BUF_ALIGN 4096
+void *bdev_buf_get(void); // NULL when out of memory
+void bdev_buf_put(void *buf);
+
+// 1 if every byte of buf is zero, used to leave holes when copying images
+int bdev_is_zero(const void *buf, size_t len);
+
+void bdev_close(BlockDevice *dev);
+
+#endif // !BLOCKDEV_H
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fs.h"
+#include "fsnet.h"
+
+static int readFull(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int writeFull(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+FsClient *fsclient_connect(const char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long.\n");
+        return NULL;
+    }
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: Could not connect to %s.\n", socket_path);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    FsClient *client = malloc(sizeof(FsClient));
+    if (!client) {
+        close(fd);
+        return NULL;
+    }
+    client->fd = fd;
+    client->next_id = 1;
+    return client;
+}
+
+void fsclient_close(FsClient *client) {
+    if (!client) return;
+    close(client->fd);
+    free(client);
+}
+
+int fsclient_send(FsClient *client, uint32_t op, const void *payload, uint32_t len) {
+    if (len > FSNET_MAX_PAYLOAD) {
+        fprintf(stderr, "Error: Request too large.\n");
+        return -1;
+    }
+
+    FsNetRequest req = { .id = client->next_id++, .op = op, .len = len };
+    if (writeFull(client->fd, &req, sizeof(req)) != 0) return -1;
+    if (len > 0 && writeFull(client->fd, payload, len) != 0) return -1;
+    return (int)req.id;
+}
+
+int fsclient_recv(FsClient *client, uint32_t *id, void *buf, uint32_t bufsize, uint32_t *len) {
+    // An id of 0 tells the caller the connection itself failed
+    if (id) *id = 0;
+    if (len) *len = 0;
+
+    FsNetResponse resp;
+    if (readFull(client->fd, &resp, sizeof(resp)) != 0) {
+        fprintf(stderr, "Error: Connection to server lost.\n");
+        return -1;
+    }
+
+    // Keep what fits and drain the rest so the stream stays in sync
+    uint32_t keep = resp.len < bufsize ? resp.len : bufsize;
+    if (keep > 0 && readFull(client->fd, buf, keep) != 0) return -1;
+    char sink[256];
+    for (uint32_t left = resp.len - keep; left > 0;) {
+        uint32_t n = left < sizeof(sink) ? left : sizeof(sink);
+        if (readFull(client->fd, sink, n) != 0) return -1;
+        left -= n;
+    }
+
+    if (id) *id = resp.id;
+    if (len) *len = keep;
+    return resp.status;
+}
+
+// Sends one request and waits for its answer
+static int call(FsClient *client, uint32_t op, const void *payload, uint32_t len,
+                void *buf, uint32_t bufsize, uint32_t *outLen) {
+    int id = fsclient_send(client, op, payload, len);
+    if (id < 0) return -1;
+
+    uint32_t gotId;
+    int status;
+    do {
+        status = fsclient_recv(client, &gotId, buf, bufsize, outLen);
+        if (gotId == 0) return -1;
+    } while (gotId != (uint32_t)id);
+    return status;
+}
+
+static int callPath(FsClient *client, uint32_t op, const char *path) {
+    uint32_t gotLen;
+    return call(client, op, path, strlen(path) + 1, NULL, 0, &gotLen);
+}
+
+int fsclient_mkdir(FsClient *client, const char *path) {
+    return callPath(client, FSNET_MKDIR, path);
+}
+
+int fsclient_create(FsClient *client, const char *path) {
+    return callPath(client, FSNET_CREATE, path);
+}
+
+int fsclient_delete(FsClient *client, const char *path) {
+    return callPath(client, FSNET_DELETE, path);
+}
+
+int fsclient_rmdir(FsClient *client, const char *path) {
+    return callPath(client, FSNET_RMDIR, path);
+}
+
+int fsclient_write(FsClient *client, const char *path, const char *data) {
+    size_t pathLen = strlen(path) + 1;
+    size_t dataLen = strlen(data);
+    if (pathLen + dataLen > FSNET_MAX_PAYLOAD) {
+        fprintf(stderr, "Error: File too large.\n");
+        return -1;
+    }
+
+    char payload[FSNET_MAX_PAYLOAD];
+    memcpy(payload, path, pathLen);
+    memcpy(payload + pathLen, data, dataLen);
+
+    uint32_t gotLen;
+    return call(client, FSNET_WRITE, payload, pathLen + dataLen, NULL, 0, &gotLen);
+}
+
+int fsclient_read(FsClient *client, const char *path, char *buf, int bufsize) {
+    uint32_t gotLen;
+    int status = call(client, FSNET_READ, path, strlen(path) + 1, buf, bufsize, &gotLen);
+    return status < 0 ? status : (int)gotLen;
+}
+
+int fsclient_ls(FsClient *client, const char *path, DirEntryPlus *entries, int max_entries, int *cookie) {
+    size_t pathLen = strlen(path) + 1;
+    if (sizeof(int32_t) + pathLen > FSNET_MAX_PAYLOAD) {
+        fprintf(stderr, "Error: Request too large.\n");
+        return -1;
+    }
+
+    char payload[FSNET_MAX_PAYLOAD];
+    int32_t in = *cookie;
+    memcpy(payload, &in, sizeof(in));
+    memcpy(payload + sizeof(in), path, pathLen);
+
+    char out[FSNET_MAX_PAYLOAD];
+    uint32_t gotLen;
+    int status = call(client, FSNET_LS, payload, sizeof(in) + pathLen, out, sizeof(out), &gotLen);
+    if (status < 0) return status;
+
+    // The server may return a larger page than asked for, hand back what fits
+    // and what the response actually holds
+    if (gotLen < sizeof(int32_t)) return -1;
+    int32_t next;
+    memcpy(&next, out, sizeof(next));
+    int count = status < max_entries ? status : max_entries;
+    if ((size_t)count > (gotLen - sizeof(next)) / sizeof(DirEntryPlus)) count = (gotLen - sizeof(next)) / sizeof(DirEntryPlus);
+    memcpy(entries, out + sizeof(next), count * sizeof(DirEntryPlus));
+    *cookie = next;
+    return count;
+}
+
+int fsclient_stats(FsClient *client, FsNetStats *stats) {
+    uint32_t gotLen;
+    return call(client, FSNET_STATS, NULL, 0, stats, sizeof(*stats), &gotLen);
+}
+
+typedef struct {
+    const char *socketPath;
+    int index;
+    int ops;
+    int depth;
+    int failures;
+    double latencySum; // Seconds summed over all completed requests
+} LoadClient;
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One load generator connection: keeps up to depth write and read requests
+// in flight against its own file
+static void *loadClientMain(void *arg) {
+    LoadClient *lc = arg;
+    FsClient *client = fsclient_connect(lc->socketPath);
+    if (!client) {
+        lc->failures = lc->ops;
+        return NULL;
+    }
+
+    char path[32];
+    snprintf(path, sizeof(path), "/loadgen%d", lc->index);
+    fsclient_create(client, path);
+
+    char payload[128];
+    size_t pathLen = strlen(path) + 1;
+    memcpy(payload, path, pathLen);
+    int writeLen = snprintf(payload + pathLen, sizeof(payload) - pathLen, "load generator client %d", lc->index);
+
+    // Send times of the requests in flight, by id. Responses may come back
+    // in any order, so a slot is only reused once its own response arrived.
+    double *sentAt = calloc(lc->depth, sizeof(double));
+    uint32_t *inFlight = calloc(lc->depth, sizeof(uint32_t));
+    char buf[BLOCK_SIZE];
+    int sent = 0;
+    int done = 0;
+
+    while (done < lc->ops && sentAt && inFlight) {
+        // Fill the pipeline, alternating writes and reads
+        while (sent < lc->ops && sent - done < lc->depth) {
+            int id = (sent % 2 == 0)
+                ? fsclient_send(client, FSNET_WRITE, payload, pathLen + writeLen)
+                : fsclient_send(client, FSNET_READ, path, pathLen);
+            if (id < 0) break;
+            int slot = 0;
+            while (inFlight[slot] != 0) slot++;
+            inFlight[slot] = id;
+            sentAt[slot] = nowSeconds();
+            sent++;
+        }
+
+        uint32_t id, len;
+        int status = fsclient_recv(client, &id, buf, sizeof(buf), &len);
+        if (id == 0) {
+            lc->failures += lc->ops - done;
+            break;
+        }
+        if (status < 0) lc->failures++;
+        for (int slot = 0; slot < lc->depth; slot++) {
+            if (inFlight[slot] != id) continue;
+            lc->latencySum += nowSeconds() - sentAt[slot];
+            inFlight[slot] = 0;
+            break;
+        }
+        done++;
+    }
+
+    callPath(client, FSNET_DELETE, path);
+    free(sentAt);
+    free(inFlight);
+    fsclient_close(client);
+    return NULL;
+}
+
+int loadgen_fs(const char *socket_path, int num_clients, int ops_per_client, int depth) {
+    if (num_clients <= 0 || ops_per_client <= 0 || depth <= 0) {
+        fprintf(stderr, "Error: Invalid arguments to loadgen_fs.\n");
+        return -1;
+    }
+
+    LoadClient *clients = calloc(num_clients, sizeof(LoadClient));
+    pthread_t *threads = calloc(num_clients, sizeof(pthread_t));
+    if (!clients || !threads) {
+        free(clients);
+        free(threads);
+        return -1;
+    }
+
+    double start = nowSeconds();
+    for (int i = 0; i < num_clients; i++) {
+        clients[i].socketPath = socket_path;
+        clients[i].index = i;
+        clients[i].ops = ops_per_client;
+        clients[i].depth = depth;
+        pthread_create(&threads[i], NULL, loadClientMain, &clients[i]);
+    }
+
+    int failures = 0;
+    double latencySum = 0;
+    for (int i = 0; i < num_clients; i++) {
+        pthread_join(threads[i], NULL);
+        failures += clients[i].failures;
+        latencySum += clients[i].latencySum;
+    }
+    double elapsed = nowSeconds() - start;
+
+    long total = (long)num_clients * ops_per_client;
+    printf("Requests: %ld, failures: %d\n", total, failures);
+    printf("Elapsed: %.3f s, throughput: %.0f requests/s\n", elapsed, total / elapsed);
+    printf("Average latency: %.1f us\n", latencySum / total * 1e6);
+
+    // Show how warm the server's cache was
+    FsClient *client = fsclient_connect(socket_path);
+    FsNetStats stats;
+    if (client && fsclient_stats(client, &stats) == 0) {
+        printf("Server requests: %llu, cache hits: %llu, cache misses: %llu\n",
+               (unsigned long long)stats.requests, (unsigned long long)stats.cache_hits,
+               (unsigned long long)stats.cache_misses);
+        printf("Writeback: %llu blocks in %llu writes, %llu dirty, %llu throttled writes\n",
+               (unsigned long long)stats.flushed_blocks, (unsigned long long)stats.flush_writes,
+               (unsigned long long)stats.dirty_blocks, (unsigned long long)stats.throttled);
+    }
+    fsclient_close(client);
+
+    free(clients);
+    free(threads);
+    return failures == 0 ? 0 : -1;
+}
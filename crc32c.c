@@ -0,0 +1,71 @@
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82F63B78 // Castagnoli polynomial, bit reversed
+
+static uint32_t table[8][256];
+static pthread_once_t tableOnce = PTHREAD_ONCE_INIT;
+static uint32_t (*impl)(uint32_t crc, const unsigned char *p, size_t len);
+
+static void buildTable(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xFF];
+    }
+}
+
+// Eight bytes per step with one table lookup per byte
+static uint32_t crcSlicing8(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+              table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+              table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crcSse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len-- > 0) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+static void pickImpl(void) {
+    buildTable();
+    impl = crcSlicing8;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) impl = crcSse42;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&tableOnce, pickImpl);
+    return ~impl(~crc, buf, len);
+}
@@ -0,0 +1,12 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli), using the SSE4.2 crc32 instruction when the CPU has it
+// and slicing-by-8 tables otherwise. Start with crc 0 and pass the result
+// back in to continue over the next buffer.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif // !CRC32C_H
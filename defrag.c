@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "fs.h"
+#include "disk.h"
+
+// Snapshot of the allocation state that defrag works on
+typedef struct {
+    uint8_t bitmap[BLOCK_SIZE];
+    Inode inodes[NUM_INODES];
+    int owner[NUM_BLOCKS]; // inode * 4 + slot owning each block, -1 if none
+} DefragState;
+
+static int loadState(BlockDevice *dev, DefragState *st) {
+    if (readBlock(dev, BITMAP_BLOCK, st->bitmap) != 0) return -1;
+
+    for (int b = 0; b < NUM_BLOCKS; b++) st->owner[b] = -1;
+
+    for (int i = 0; i < NUM_INODES; i++) {
+        if (readInode(dev, i, &st->inodes[i]) != 0) return -1;
+        if (!st->inodes[i].is_valid) continue;
+        for (int s = 0; s < 4; s++) {
+            int blk = st->inodes[i].direct_blocks[s];
+            if (blk >= DATA_START_BLOCK && blk < NUM_BLOCKS) {
+                st->owner[blk] = i * 4 + s;
+            }
+        }
+    }
+    return 0;
+}
+
+// Fills the fragmentation report from an in-memory snapshot
+static void buildReport(const DefragState *st, FragReport *out) {
+    memset(out, 0, sizeof(*out));
+
+    for (int i = 0; i < NUM_INODES; i++) {
+        const Inode *inode = &st->inodes[i];
+        if (!inode->is_valid) continue;
+
+        // Count the runs of consecutive blocks in slot order
+        int extents = 0;
+        int prev = -2;
+        for (int s = 0; s < 4; s++) {
+            int blk = inode->direct_blocks[s];
+            if (blk < DATA_START_BLOCK || blk >= NUM_BLOCKS) continue;
+            if (blk != prev + 1) extents++;
+            prev = blk;
+        }
+
+        out->files++;
+        out->extents += extents;
+        if (extents > 1) out->fragmented_files++;
+    }
+
+    int run = 0;
+    for (int b = DATA_START_BLOCK; b < NUM_BLOCKS; b++) {
+        if (bitmapTest(st->bitmap, b)) {
+            out->used_blocks++;
+            out->last_used_block = b;
+            run = 0;
+        } else {
+            out->free_blocks++;
+            if (run == 0) out->free_extents++;
+            run++;
+            if (run > out->largest_free_extent) out->largest_free_extent = run;
+        }
+    }
+}
+
+// Moves one block of an inode to a free destination block. The data is copied
+// and the destination is marked in the bitmap before the inode is repointed,
+// and the source is only released afterwards, so a crash at any point leaves
+// at worst a leaked block, never a block shared by two inodes.
+static int moveBlock(BlockDevice *dev, DefragState *st, int inode_index, int slot, int dst) {
+    Inode *inode = &st->inodes[inode_index];
+    int src = inode->direct_blocks[slot];
+    char block[BLOCK_SIZE];
+
+    if (readBlock(dev, src, block) != 0 || writeBlock(dev, dst, block) != 0) return -1;
+
+    bitmapSet(st->bitmap, dst);
+    if (writeBlock(dev, BITMAP_BLOCK, st->bitmap) != 0) return -1;
+
+    inode->direct_blocks[slot] = dst;
+    if (writeInode(dev, inode_index, inode) != 0) return -1;
+
+    bitmapClear(st->bitmap, src);
+    if (writeBlock(dev, BITMAP_BLOCK, st->bitmap) != 0) return -1;
+
+    st->owner[dst] = inode_index * 4 + slot;
+    st->owner[src] = -1;
+    return 0;
+}
+
+// Highest free data block above the given one, used to park displaced blocks
+// out of the way of the prefix being compacted
+static int highestFreeBlock(const DefragState *st, int above) {
+    for (int b = NUM_BLOCKS - 1; b > above; b--) {
+        if (!bitmapTest(st->bitmap, b)) return b;
+    }
+    return -1;
+}
+
+int fragreport_fs(FragReport *report) {
+    if (!report) {
+        fprintf(stderr, "Error: Invalid arguments to fragreport_fs.\n");
+        return -1;
+    }
+
+    // Open the disk image file for reading
+    BlockDevice *dev = openDisk(DISK_RDONLY);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    DefragState *st = malloc(sizeof(DefragState));
+    if (!st || loadState(dev, st) != 0) {
+        fprintf(stderr, "Error: Failed to read filesystem metadata.\n");
+        free(st);
+        closeDisk(dev);
+        return -1;
+    }
+
+    buildReport(st, report);
+
+    free(st);
+    closeDisk(dev);
+    return 0;
+}
+
+// Measures how far each file's blocks are from its directory and from each
+// other, using the directory entries to find every file's parent
+static int buildLayoutReport(BlockDevice *dev, const DefragState *st, LayoutReport *out) {
+    memset(out, 0, sizeof(*out));
+    out->groups = NUM_BLOCK_GROUPS;
+
+    int parent[NUM_INODES];
+    for (int i = 0; i < NUM_INODES; i++) parent[i] = -1;
+
+    DirectoryEntry entries[MAX_DIR_ENTRIES];
+    for (int d = 0; d < NUM_INODES; d++) {
+        const Inode *dir = &st->inodes[d];
+        if (!dir->is_valid || !dir->is_directory) continue;
+        for (int s = 0; s < 4; s++) {
+            int blk = dir->direct_blocks[s];
+            if (blk < DATA_START_BLOCK || blk >= NUM_BLOCKS) continue;
+            if (readBlock(dev, blk, entries) != 0) return -1;
+            for (int j = 0; j < MAX_DIR_ENTRIES; j++) {
+                int child = entries[j].inode_number;
+                if (child < 0 || child >= NUM_INODES) continue;
+                if (strcmp(entries[j].name, ".") == 0 || strcmp(entries[j].name, "..") == 0) continue;
+                parent[child] = d;
+            }
+        }
+    }
+
+    long parentDistance = 0;
+    long gaps = 0;
+    for (int i = 0; i < NUM_INODES; i++) {
+        const Inode *inode = &st->inodes[i];
+        if (!inode->is_valid || inode->is_directory || parent[i] == -1) continue;
+
+        int first = -1;
+        int prev = -1;
+        for (int s = 0; s < 4; s++) {
+            int blk = inode->direct_blocks[s];
+            if (blk < DATA_START_BLOCK || blk >= NUM_BLOCKS) continue;
+            if (first == -1) first = blk;
+            else gaps += abs(blk - prev - 1);
+            prev = blk;
+        }
+        int dirBlock = st->inodes[parent[i]].direct_blocks[0];
+        if (first == -1 || dirBlock < DATA_START_BLOCK || dirBlock >= NUM_BLOCKS) continue;
+
+        out->files++;
+        parentDistance += abs(first - dirBlock);
+        if (BLOCK_GROUP(first) != BLOCK_GROUP(dirBlock)) out->cross_group_files++;
+    }
+
+    if (out->files > 0) {
+        out->avg_parent_distance = (double)parentDistance / out->files;
+        out->avg_gap = (double)gaps / out->files;
+    }
+    return 0;
+}
+
+int layoutreport_fs(LayoutReport *report) {
+    if (!report) {
+        fprintf(stderr, "Error: Invalid arguments to layoutreport_fs.\n");
+        return -1;
+    }
+
+    // Open the disk image file for reading
+    BlockDevice *dev = openDisk(DISK_RDONLY);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    DefragState *st = malloc(sizeof(DefragState));
+    if (!st || loadState(dev, st) != 0 || buildLayoutReport(dev, st, report) != 0) {
+        fprintf(stderr, "Error: Failed to read filesystem metadata.\n");
+        free(st);
+        closeDisk(dev);
+        return -1;
+    }
+
+    free(st);
+    closeDisk(dev);
+    return 0;
+}
+
+int defrag_fs(int max_moves, FragReport *report) {
+    // Open the disk image file for reading and writing
+    BlockDevice *dev = openDisk(DISK_RDWR);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    DefragState *st = malloc(sizeof(DefragState));
+    if (!st || loadState(dev, st) != 0) {
+        fprintf(stderr, "Error: Failed to read filesystem metadata.\n");
+        free(st);
+        closeDisk(dev);
+        return -1;
+    }
+
+    // Lay the blocks of every inode out back to back from the start of the
+    // data area, in inode order. Everything below the cursor is final.
+    int cursor = DATA_START_BLOCK;
+    int moves = 0;
+    int done = 0;
+
+    for (int i = 0; i < NUM_INODES && !done; i++) {
+        if (!st->inodes[i].is_valid) continue;
+
+        for (int s = 0; s < 4 && !done; s++) {
+            int blk = st->inodes[i].direct_blocks[s];
+            if (blk < DATA_START_BLOCK || blk >= NUM_BLOCKS) continue;
+
+            // Allocated blocks that no inode owns cannot be moved, step over them
+            while (cursor < NUM_BLOCKS && bitmapTest(st->bitmap, cursor) && st->owner[cursor] == -1) {
+                cursor++;
+            }
+
+            // Only unmovable blocks are left past the cursor, nothing more
+            // can be compacted
+            if (cursor >= NUM_BLOCKS) {
+                done = 1;
+                break;
+            }
+            int target = cursor++;
+            if (blk == target) continue;
+
+            // Stop before exceeding the per-run budget, placing a block costs
+            // two moves when its target has to be vacated first
+            int occupied = bitmapTest(st->bitmap, target);
+            if (max_moves > 0 && moves + (occupied ? 2 : 1) > max_moves) {
+                done = 1;
+                break;
+            }
+
+            // Target is held by another block, park that block at the end of the disk first
+            if (occupied) {
+                int spare = highestFreeBlock(st, target);
+                if (spare == -1) {
+                    // No room to shuffle through, the image is full
+                    done = 1;
+                    break;
+                }
+                int occupant = st->owner[target];
+                if (moveBlock(dev, st, occupant / 4, occupant % 4, spare) != 0) {
+                    fprintf(stderr, "Error: Failed to relocate block %d.\n", target);
+                    free(st);
+                    closeDisk(dev);
+                    return -1;
+                }
+                moves++;
+            }
+
+            if (moveBlock(dev, st, i, s, target) != 0) {
+                fprintf(stderr, "Error: Failed to relocate block %d.\n", blk);
+                free(st);
+                closeDisk(dev);
+                return -1;
+            }
+            moves++;
+        }
+    }
+
+    if (report) buildReport(st, report);
+
+    free(st);
+    closeDisk(dev);
+    return moves;
+}
@@ -1,6 +1,11 @@
 #ifndef DISK_H
+#define DISK_H
 
-#define BLOCK_SIZE 1024 // Size of each block in bytes
+// Size of each block in bytes, chosen at build time with make BLOCK_SIZE=4096
+// e.g. to match the 4 KiB sectors direct I/O needs on most disks
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 1024
+#endif
 #define NUM_BLOCKS 1024 // Total number of blocks in the filesystem
 #define NUM_INODES 128 // Total number of inodes, using 128 as in the example
 #define MAGIC_NUMBER 0x4D465359  // "MFSY" (Mini File System)
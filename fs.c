@@ -2,8 +2,23 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "fs.h"
 #include "disk.h"
+#include "crc32c.h"
+
+// Feature flags of the device in use, taken from its superblock when it is
+// mounted or opened
+static int diskFeatures = 0;
+static int mkfsDataChecksums = 0;
+static int mkfsStripeFiles = 0;
+static int mkfsStripeUnit = 0;
+static int directIo = 0;
+
+static void flushGenerations(BlockDevice *dev);
 
 int rmdir_fs(const char *path) {
     // Check if the path is absolute
@@ -19,8 +34,8 @@ int rmdir_fs(const char *path) {
     }
 
     // Open the disk image file for reading and writing
-    FILE *fp = fopen("disk.img", "rb+");
-    if (!fp) {
+    BlockDevice *dev = openDisk(DISK_RDWR);
+    if (!dev) {
         fprintf(stderr, "Error: Could not open disk image.\n");
         return -1;
     }
@@ -28,20 +43,20 @@ int rmdir_fs(const char *path) {
     // Resolve the path to find the directory's inode and its parent
     int parentInode = -1;  // Will store the parent directory's inode index
     char name[28];         // Will store the directory name (last component of path)
-    int dirInodeIndex = resolvePath(fp, path, &parentInode, name);
+    int dirInodeIndex = resolvePath(dev, path, &parentInode, name);
     
     // Check if the directory exists
     if (dirInodeIndex == -1) {
         fprintf(stderr, "Error: Directory not found.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
     // Read the directory's inode and verify it's actually a directory
     Inode dirInode;
-    if (readInode(fp, dirInodeIndex, &dirInode) != 0 || !dirInode.is_directory) {
+    if (readInode(dev, dirInodeIndex, &dirInode) != 0 || !dirInode.is_directory) {
         fprintf(stderr, "Error: Path is not a directory.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
@@ -54,9 +69,9 @@ int rmdir_fs(const char *path) {
         if (dirInode.direct_blocks[i] == -1) continue;
         
         // Read the directory entries from this block
-        if (readBlock(fp, dirInode.direct_blocks[i], entries) != 0) {
+        if (readBlock(dev, dirInode.direct_blocks[i], entries) != 0) {
             fprintf(stderr, "Error: Failed to read directory block.\n");
-            fclose(fp);
+            closeDisk(dev);
             return -1;
         }
         
@@ -67,7 +82,7 @@ int rmdir_fs(const char *path) {
                 strcmp(entries[j].name, ".") != 0 &&
                 strcmp(entries[j].name, "..") != 0) {
                 fprintf(stderr, "Error: Directory is not empty.\n");
-                fclose(fp);
+                closeDisk(dev);
                 return -1;
             }
         }
@@ -76,22 +91,23 @@ int rmdir_fs(const char *path) {
     // Directory is empty, can be removed, first free all allocated data blocks
     for (int i = 0; i < 4; i++) {
         if (dirInode.direct_blocks[i] != -1) {
-            freeDataBlock(fp, dirInode.direct_blocks[i]);
+            freeDataBlock(dev, dirInode.direct_blocks[i]);
         }
     }
 
     // Free the directory's inode to make it available for reuse
-    freeInode(fp, dirInodeIndex);
+    freeInode(dev, dirInodeIndex);
 
     // Remove the directory entry from its parent directory
-    if (removeDirEntry(fp, parentInode, name) != 0) {
+    if (removeDirEntry(dev, parentInode, name) != 0) {
         fprintf(stderr, "Error: Failed to remove directory entry from parent.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
+    chargeUsage(dev, parentInode, 0, -1);
 
     // Close the disk image file and return
-    fclose(fp);
+    closeDisk(dev);
     return 0;
 }
 
@@ -104,8 +120,8 @@ int delete_fs(const char *path) {
     }
 
     // Open the disk image file for reading and writing
-    FILE *fp = fopen("disk.img", "rb+");
-    if (!fp) {
+    BlockDevice *dev = openDisk(DISK_RDWR);
+    if (!dev) {
         fprintf(stderr, "Error: Could not open disk image.\n");
         return -1;
     }
@@ -113,20 +129,20 @@ int delete_fs(const char *path) {
     // Resolve the path to find the file's inode and its parent directory
     int parentInode = -1;  // Will store the parent directory's inode index
     char name[28];         // Will store the file name (last component of path)
-    int inodeIndex = resolvePath(fp, path, &parentInode, name);
+    int inodeIndex = resolvePath(dev, path, &parentInode, name);
     
     // Check if the file exists
     if (inodeIndex == -1) {
         fprintf(stderr, "Error: File not found.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
     // Read the file's inode and verify it's actually a file (not a directory)
     Inode fileInode;
-    if (readInode(fp, inodeIndex, &fileInode) != 0 || fileInode.is_directory) {
+    if (readInode(dev, inodeIndex, &fileInode) != 0 || fileInode.is_directory) {
         fprintf(stderr, "Error: Path is not a file.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
@@ -135,23 +151,165 @@ int delete_fs(const char *path) {
         // Check if this direct block is allocated
         if (fileInode.direct_blocks[i] != -1) {
             // Free the data block and mark it as unallocated
-            freeDataBlock(fp, fileInode.direct_blocks[i]);
+            freeDataBlock(dev, fileInode.direct_blocks[i]);
             fileInode.direct_blocks[i] = -1;  // Mark as freed
         }
     }
 
     // Free the file's inode to make it available for reuse
-    freeInode(fp, inodeIndex);
+    freeInode(dev, inodeIndex);
 
     // Remove the file entry from its parent directory
-    if (removeDirEntry(fp, parentInode, name) != 0) {
+    if (removeDirEntry(dev, parentInode, name) != 0) {
         fprintf(stderr, "Error: Failed to remove directory entry.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
+    chargeUsage(dev, parentInode, -fileInode.size, -1);
 
     // Close the disk image file and return success
-    fclose(fp);
+    closeDisk(dev);
+    return 0;
+}
+
+
+int rename_fs(const char *oldpath, const char *newpath) {
+    // Validate input: ensure both paths exist and are absolute
+    if (!oldpath || !newpath || oldpath[0] != '/' || newpath[0] != '/') {
+        fprintf(stderr, "Error: Only absolute paths are supported.\n");
+        return -1;
+    }
+
+    // Neither side may be the root
+    if (strcmp(oldpath, "/") == 0 || strcmp(newpath, "/") == 0) {
+        fprintf(stderr, "Error: Cannot rename root.\n");
+        return -1;
+    }
+
+    // The new name has to fit in a directory entry
+    const char *newName = strrchr(newpath, '/') + 1;
+    if (strlen(newName) == 0 || strlen(newName) > 27) {
+        fprintf(stderr, "Error: Invalid target name.\n");
+        return -1;
+    }
+
+    // Open the disk image file for reading and writing
+    BlockDevice *dev = openDisk(DISK_RDWR);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    // Resolve the source and its parent directory
+    int srcParent = -1;
+    char srcName[28];
+    int srcInodeIndex = resolvePath(dev, oldpath, &srcParent, srcName);
+    if (srcInodeIndex == -1) {
+        fprintf(stderr, "Error: Source not found.\n");
+        closeDisk(dev);
+        return -1;
+    }
+
+    // Resolve the target, which may or may not exist yet
+    int dstParent = -1;
+    char dstName[28];
+    int dstInodeIndex = resolvePath(dev, newpath, &dstParent, dstName);
+    if (dstParent == -1) {
+        fprintf(stderr, "Error: Parent directory does not exist.\n");
+        closeDisk(dev);
+        return -1;
+    }
+
+    // Renaming something onto itself is a no-op
+    if (dstInodeIndex == srcInodeIndex) {
+        closeDisk(dev);
+        return 0;
+    }
+
+    Inode srcInode;
+    if (readInode(dev, srcInodeIndex, &srcInode) != 0) {
+        fprintf(stderr, "Error: Failed to read source inode.\n");
+        closeDisk(dev);
+        return -1;
+    }
+
+    // A directory cannot be moved below itself, walk up from the new parent
+    if (srcInode.is_directory) {
+        for (int cur = dstParent; cur > 0; cur = findDirEntry(dev, cur, "..")) {
+            if (cur == srcInodeIndex) {
+                fprintf(stderr, "Error: Cannot move a directory into itself.\n");
+                closeDisk(dev);
+                return -1;
+            }
+        }
+    }
+
+    Inode dstInode = {0};
+    if (dstInodeIndex != -1) {
+        // Only a file may replace a file, and only a directory an empty directory
+        if (readInode(dev, dstInodeIndex, &dstInode) != 0 ||
+            dstInode.is_directory != srcInode.is_directory) {
+            fprintf(stderr, "Error: Source and target are not the same type.\n");
+            closeDisk(dev);
+            return -1;
+        }
+        if (dstInode.is_directory && dstInode.size > 0) {
+            fprintf(stderr, "Error: Directory is not empty.\n");
+            closeDisk(dev);
+            return -1;
+        }
+
+        // Swing the existing entry over to the source with a single block
+        // write, so the target name always refers to either the old or the new
+        if (replaceDirEntry(dev, dstParent, dstName, srcInodeIndex) != 0) {
+            fprintf(stderr, "Error: Failed to replace target entry.\n");
+            closeDisk(dev);
+            return -1;
+        }
+    } else {
+        // Link the new name first, so a failure never leaves the inode unnamed
+        if (addDirEntry(dev, dstParent, dstName, srcInodeIndex) != 0) {
+            fprintf(stderr, "Error: Failed to link target entry.\n");
+            closeDisk(dev);
+            return -1;
+        }
+    }
+
+    // Drop the old name
+    if (removeDirEntry(dev, srcParent, srcName) != 0) {
+        fprintf(stderr, "Error: Failed to remove source entry.\n");
+        closeDisk(dev);
+        return -1;
+    }
+
+    // A moved directory's ".." has to follow it to the new parent
+    if (srcInode.is_directory && srcParent != dstParent &&
+        replaceDirEntry(dev, srcInodeIndex, "..", dstParent) != 0) {
+        fprintf(stderr, "Error: Failed to update parent link.\n");
+        closeDisk(dev);
+        return -1;
+    }
+
+    // Move the usage of the renamed tree, and drop that of a replaced target
+    if (srcParent != dstParent) {
+        DirUsage moved = { .bytes = srcInode.is_directory ? 0 : srcInode.size, .inodes = 0 };
+        if (srcInode.is_directory) readUsage(dev, srcInodeIndex, &moved);
+        chargeUsage(dev, srcParent, -moved.bytes, -moved.inodes - 1);
+        chargeUsage(dev, dstParent, moved.bytes, moved.inodes + 1);
+    }
+    if (dstInodeIndex != -1) {
+        chargeUsage(dev, dstParent, dstInode.is_directory ? 0 : -dstInode.size, -1);
+    }
+
+    // Release whatever the target used to be
+    if (dstInodeIndex != -1) {
+        for (int i = 0; i < 4; ++i) {
+            if (dstInode.direct_blocks[i] != -1) freeDataBlock(dev, dstInode.direct_blocks[i]);
+        }
+        freeInode(dev, dstInodeIndex);
+    }
+
+    closeDisk(dev);
     return 0;
 }
 
@@ -163,146 +321,231 @@ int read_fs(const char *path, char *buf, int bufSize) {
         return -1;
     }
 
+    // A single buffer is the one-element case of a vectored read
+    struct iovec iov = { .iov_base = buf, .iov_len = bufSize };
+    return readv_fs(path, &iov, 1);
+}
+
+
+int write_fs(const char *path, const char *data) {
+    // Ensure path is absolute 
+    if (!path || path[0] != '/') {
+        fprintf(stderr, "Error: Only absolute paths are supported.\n");
+        return -1;
+    }
+    
+    // Empty data will be written as an empty file, so not checking for size 0
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = strlen(data) };
+    return writev_fs(path, &iov, 1);
+}
+
+
+// Builds the part of an iovec array that covers bytes [offset, offset + len)
+// of the concatenated buffers, returns the number of entries used or -1 if
+// more than max_out entries or more bytes than the buffers hold are needed
+static int sliceIovec(const struct iovec *iov, int iovcnt, size_t offset, size_t len,
+                      struct iovec *out, int max_out) {
+    int n = 0;
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        if (n == max_out) return -1;
+        size_t take = iov[i].iov_len - offset;
+        if (take > len) take = len;
+        out[n].iov_base = (char *)iov[i].iov_base + offset;
+        out[n].iov_len = take;
+        n++;
+        len -= take;
+        offset = 0;
+    }
+    return len > 0 ? -1 : n;
+}
+
+// Number of blocks starting at slot that are laid out back to back on disk
+static int contiguousRun(const Inode *inode, int slot, int nblocks) {
+    int run = 1;
+    while (slot + run < nblocks && inode->direct_blocks[slot + run] == inode->direct_blocks[slot] + run) run++;
+    return run;
+}
+
+int readv_fs(const char *path, const struct iovec *iov, int iovcnt) {
+    // Check input, ensure path is absolute and the vector is valid. The block
+    // layer needs one entry to spare, as writev_fs does for its padding.
+    if (!path || path[0] != '/' || !iov || iovcnt <= 0 || iovcnt >= BDEV_IOV_MAX) {
+        fprintf(stderr, "Error: Invalid arguments to readv_fs.\n");
+        return -1;
+    }
+
+    size_t bufSize = 0;
+    for (int i = 0; i < iovcnt; i++) bufSize += iov[i].iov_len;
+
     // Open the disk image file for reading
-    FILE *fp = fopen("disk.img", "rb");
-    if (!fp) {
+    BlockDevice *dev = openDisk(DISK_RDONLY);
+    if (!dev) {
         fprintf(stderr, "Error: Could not open disk image.\n");
         return -1;
     }
 
     // Resolve the path to find the file's inode
-    int inodeIndex = resolvePath(fp, path, NULL, NULL);
+    int inodeIndex = resolvePath(dev, path, NULL, NULL);
     if (inodeIndex == -1) {
         fprintf(stderr, "Error: File not found.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
     // Read the inode for the file while checking if it's a file
     Inode inode;
-    if (readInode(fp, inodeIndex, &inode) != 0 || inode.is_directory) {
+    if (readInode(dev, inodeIndex, &inode) != 0 || inode.is_directory) {
         fprintf(stderr, "Error: Path is not a file.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
-    int toRead = (inode.size < bufSize) ? inode.size : bufSize;
+    int toRead = ((size_t)inode.size < bufSize) ? inode.size : (int)bufSize;
+    int nblocks = (toRead + BLOCK_SIZE - 1) / BLOCK_SIZE;
     int readBytes = 0;
 
-    for (int i = 0; i < 4 && readBytes < toRead; i++) {
-        if (inode.direct_blocks[i] == -1) continue;
-
-        char block[BLOCK_SIZE] = {0};
-        if (readBlock(fp, inode.direct_blocks[i], block) != 0) {
+    // Move each run of contiguous blocks straight into the caller's buffers
+    // with a single vectored read
+    struct iovec slice[BDEV_IOV_MAX];
+    for (int b = 0; b < nblocks;) {
+        if (inode.direct_blocks[b] == -1) break;
+        int run = contiguousRun(&inode, b, nblocks);
+        size_t len = (size_t)run * BLOCK_SIZE;
+        if (len > (size_t)(toRead - readBytes)) len = toRead - readBytes;
+
+        int n = sliceIovec(iov, iovcnt, readBytes, len, slice, BDEV_IOV_MAX - 1);
+        if (n < 0 || readBlocksv(dev, inode.direct_blocks[b], slice, n) != 0) {
             fprintf(stderr, "Error: Failed to read data block.\n");
-            fclose(fp);
+            closeDisk(dev);
             return -1;
         }
-
-        // Calculate how much to copy from this block 
-        int copyLen = (toRead - readBytes > BLOCK_SIZE) ? BLOCK_SIZE : (toRead - readBytes);
-        // Copy the data from the block to the buffer
-        memcpy(buf + readBytes, block, copyLen);
-        // Update the number of bytes read
-        readBytes += copyLen;
+        readBytes += len;
+        b += run;
     }
 
-    fclose(fp);
+    closeDisk(dev);
     return readBytes;
 }
 
 
-int write_fs(const char *path, const char *data) {
-    // Ensure path is absolute 
+int writev_fs(const char *path, const struct iovec *iov, int iovcnt) {
+    // Ensure path is absolute and the vector is valid
     if (!path || path[0] != '/') {
         fprintf(stderr, "Error: Only absolute paths are supported.\n");
         return -1;
     }
-    
-    // Empty data will be written as an empty file, so not checking for size 0
-    int dataLen = strlen(data);
+    if (iovcnt < 0 || iovcnt >= BDEV_IOV_MAX || (iovcnt > 0 && !iov)) {
+        fprintf(stderr, "Error: Invalid arguments to writev_fs.\n");
+        return -1;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
 
     // Check if data length exceeds the maximum allowed size
-    if (dataLen > BLOCK_SIZE * 4) {
+    if (total > BLOCK_SIZE * 4) {
         fprintf(stderr, "Error: File too large.\n");
         return -1;
     }
+    int dataLen = (int)total;
 
     // Open the disk image file
-    FILE *fp = fopen("disk.img", "rb+");
-    if (!fp) {
+    BlockDevice *dev = openDisk(DISK_RDWR);
+    if (!dev) {
         fprintf(stderr, "Error: Could not open disk image.\n");
         return -1;
     }
 
     // Resolve the path to find the file's inode and its parent directory
-    int fileInodeIndex = resolvePath(fp, path, NULL, NULL);
+    int parentInode = -1;
+    int fileInodeIndex = resolvePath(dev, path, &parentInode, NULL);
     if (fileInodeIndex == -1) {
         fprintf(stderr, "Error: File does not exist.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
     // Read the inode for the file and check if it is a file 
     Inode fileInode;
-    if (readInode(fp, fileInodeIndex, &fileInode) != 0 || fileInode.is_directory) {
+    if (readInode(dev, fileInodeIndex, &fileInode) != 0 || fileInode.is_directory) {
         fprintf(stderr, "Error: Target is not a file.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
     // Free any previously allocated data blocks
+    int oldSize = fileInode.size;
     for (int i = 0; i < 4; ++i) {
         if (fileInode.direct_blocks[i] != -1) {
-            freeDataBlock(fp, fileInode.direct_blocks[i]);
+            freeDataBlock(dev, fileInode.direct_blocks[i]);
             fileInode.direct_blocks[i] = -1;
         }
     }
 
-    int remaining = dataLen;
-    const char *ptr = data;
-    int blocksUsed = 0;
-
-    // Allocate new data blocks for the file
-    while (remaining > 0 && blocksUsed < 4) {
-        int blk = allocDataBlock(fp);
+    // Allocate new data blocks for the file, starting next to its directory's
+    // block and keeping each block right after the one before it
+    Inode parent;
+    int goal = -1;
+    if (readInode(dev, parentInode == -1 ? 0 : parentInode, &parent) == 0) goal = parent.direct_blocks[0];
+    int nblocks = (dataLen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int b = 0; b < nblocks; b++) {
+        int blk = allocDataBlockNear(dev, goal);
         if (blk == -1) {
             fprintf(stderr, "Error: No space to allocate data blocks.\n");
-            fclose(fp);
+            closeDisk(dev);
             return -1;
         }
+        fileInode.direct_blocks[b] = blk;
+        goal = blk + 1;
+    }
 
-        // Calculate how much data to write in this block
-        int toWrite = remaining > BLOCK_SIZE ? BLOCK_SIZE : remaining;
-        
-        // Create a temporary block buffer and copy only the data required
-        char block[BLOCK_SIZE] = {0};
-        memcpy(block, ptr, toWrite);
-        
-        // Use writeBlock to write the data to the allocated block
-        if (writeBlock(fp, blk, block) != 0) {
+    // Write each run of contiguous blocks straight from the caller's buffers,
+    // padding the last block with zeros instead of staging it in a temp block
+    static const char zeros[BLOCK_SIZE];
+    struct iovec slice[BDEV_IOV_MAX];
+    int written = 0;
+    for (int b = 0; b < nblocks;) {
+        int run = contiguousRun(&fileInode, b, nblocks);
+        size_t len = (size_t)run * BLOCK_SIZE;
+        if (len > (size_t)(dataLen - written)) len = dataLen - written;
+
+        int n = sliceIovec(iov, iovcnt, written, len, slice, BDEV_IOV_MAX - 1);
+        if (n < 0) {
             fprintf(stderr, "Error: Failed to write to block.\n");
-            fclose(fp);
+            closeDisk(dev);
             return -1;
         }
+        size_t pad = (size_t)run * BLOCK_SIZE - len;
+        if (pad > 0) {
+            slice[n].iov_base = (void *)zeros;
+            slice[n].iov_len = pad;
+            n++;
+        }
 
-        // Update the inode's direct block pointers
-        fileInode.direct_blocks[blocksUsed] = blk;
-        ptr += toWrite;
-        remaining -= toWrite;
-        blocksUsed++;
+        if (writeBlocksv(dev, fileInode.direct_blocks[b], slice, n) != 0) {
+            fprintf(stderr, "Error: Failed to write to block.\n");
+            closeDisk(dev);
+            return -1;
+        }
+        written += len;
+        b += run;
     }
 
     fileInode.size = dataLen;
 
     // Update the inode with the new size and block pointers
-    if (writeInode(fp, fileInodeIndex, &fileInode) != 0) {
+    if (writeInode(dev, fileInodeIndex, &fileInode) != 0) {
         fprintf(stderr, "Error: Failed to update inode.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
+    chargeUsage(dev, parentInode, dataLen - oldSize, 0);
 
-    fclose(fp);
+    closeDisk(dev);
     return dataLen;
 }
 
@@ -315,25 +558,25 @@ int ls_fs(const char *path, DirectoryEntry *entries, int max_entries) {
     }
 
     // Open the disk image file 
-    FILE *fp = fopen("disk.img", "rb");
-    if (!fp) {
+    BlockDevice *dev = openDisk(DISK_RDONLY);
+    if (!dev) {
         fprintf(stderr, "Error: Could not open disk image.\n");
         return -1;
     }
 
     // Resolve the path to find the directory's inode
-    int dirInodeIndex = resolvePath(fp, path, NULL, NULL);
+    int dirInodeIndex = resolvePath(dev, path, NULL, NULL);
     if (dirInodeIndex == -1) {
         fprintf(stderr, "Error: Directory not found.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
     // Read the inode and check that if it is a directory
     Inode dirInode;
-    if (readInode(fp, dirInodeIndex, &dirInode) != 0 || !dirInode.is_directory) {
+    if (readInode(dev, dirInodeIndex, &dirInode) != 0 || !dirInode.is_directory) {
         fprintf(stderr, "Error: Path is not a directory.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
@@ -347,9 +590,9 @@ int ls_fs(const char *path, DirectoryEntry *entries, int max_entries) {
         if (dirInode.direct_blocks[i] == -1) continue;
 
         // Read the directory entries from this data block
-        if (readBlock(fp, dirInode.direct_blocks[i], blockEntries) != 0) {
+        if (readBlock(dev, dirInode.direct_blocks[i], blockEntries) != 0) {
             fprintf(stderr, "Error: Failed to read directory block.\n");
-            fclose(fp);
+            closeDisk(dev);
             return -1;
         }
 
@@ -366,7 +609,112 @@ int ls_fs(const char *path, DirectoryEntry *entries, int max_entries) {
     }
 
     // Close the disk image file and return the number of entries found
-    fclose(fp);
+    closeDisk(dev);
+    return count;
+}
+
+
+int readdirplus_fs(const char *path, DirEntryPlus *entries, int max_entries, int *cookie) {
+    // Ensure path exists and is absolute, and the cookie points at a position
+    if (!path || path[0] != '/' || !entries || max_entries <= 0 || !cookie) {
+        fprintf(stderr, "Error: Invalid arguments to readdirplus_fs.\n");
+        return -1;
+    }
+
+    // A finished listing stays finished
+    if (*cookie == READDIR_END) return 0;
+
+    int totalSlots = 4 * MAX_DIR_ENTRIES;
+    if (*cookie < 0 || *cookie >= totalSlots) {
+        fprintf(stderr, "Error: Invalid readdir cookie.\n");
+        return -1;
+    }
+
+    // Open the disk image file
+    BlockDevice *dev = openDisk(DISK_RDONLY);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    // Resolve the path to find the directory's inode
+    int dirInodeIndex = resolvePath(dev, path, NULL, NULL);
+    if (dirInodeIndex == -1) {
+        fprintf(stderr, "Error: Directory not found.\n");
+        closeDisk(dev);
+        return -1;
+    }
+
+    // Read the inode and check that if it is a directory
+    Inode dirInode;
+    if (readInode(dev, dirInodeIndex, &dirInode) != 0 || !dirInode.is_directory) {
+        fprintf(stderr, "Error: Path is not a directory.\n");
+        closeDisk(dev);
+        return -1;
+    }
+
+    // Collect entries starting at the cookie position, a position is the
+    // block slot times the entries per block plus the entry index
+    int count = 0;
+    int pos = *cookie;
+    DirectoryEntry blockEntries[MAX_DIR_ENTRIES];
+
+    while (pos < totalSlots && count < max_entries) {
+        int slot = pos / MAX_DIR_ENTRIES;
+
+        // Skip unallocated blocks entirely
+        if (dirInode.direct_blocks[slot] == -1) {
+            pos = (slot + 1) * MAX_DIR_ENTRIES;
+            continue;
+        }
+
+        if (readBlock(dev, dirInode.direct_blocks[slot], blockEntries) != 0) {
+            fprintf(stderr, "Error: Failed to read directory block.\n");
+            closeDisk(dev);
+            return -1;
+        }
+
+        for (int j = pos % MAX_DIR_ENTRIES; j < MAX_DIR_ENTRIES && count < max_entries; j++, pos++) {
+            // Only include valid entries that are not the special "." and ".." directories
+            if (blockEntries[j].inode_number != -1 &&
+                strcmp(blockEntries[j].name, ".") != 0 &&
+                strcmp(blockEntries[j].name, "..") != 0) {
+                entries[count].inode_number = blockEntries[j].inode_number;
+                memcpy(entries[count].name, blockEntries[j].name, sizeof(entries[count].name));
+                entries[count].name[sizeof(entries[count].name) - 1] = '\0';
+                count++;
+            }
+        }
+    }
+
+    // Fill in the attributes, reading each inode table block only once no
+    // matter how many of the returned entries live in it
+    int inodesPerBlock = BLOCK_SIZE / sizeof(Inode);
+    int tableBlocks = DATA_START_BLOCK - INODE_START_BLOCK;
+    Inode table[BLOCK_SIZE / sizeof(Inode)];
+
+    for (int b = 0; b < tableBlocks; b++) {
+        int loaded = 0;
+        for (int k = 0; k < count; k++) {
+            if (entries[k].inode_number / inodesPerBlock != b) continue;
+            if (!loaded) {
+                if (readBlock(dev, INODE_START_BLOCK + b, table) != 0) {
+                    fprintf(stderr, "Error: Failed to read inode table.\n");
+                    closeDisk(dev);
+                    return -1;
+                }
+                loaded = 1;
+            }
+            const Inode *inode = &table[entries[k].inode_number % inodesPerBlock];
+            entries[k].is_directory = inode->is_directory;
+            entries[k].size = inode->size;
+        }
+    }
+
+    // Hand back where to continue, or mark the listing as finished
+    *cookie = (pos >= totalSlots) ? READDIR_END : pos;
+
+    closeDisk(dev);
     return count;
 }
 
@@ -379,8 +727,8 @@ int create_fs(const char *path) {
     }
 
     // Open the disk image file
-    FILE *fp = fopen("disk.img", "rb+");
-    if (!fp) {
+    BlockDevice *dev = openDisk(DISK_RDWR);
+    if (!dev) {
         fprintf(stderr, "Error: Could not open disk image.\n");
         return -1;
     }
@@ -390,25 +738,25 @@ int create_fs(const char *path) {
     int parentInode = -1;
     char name[28];
     
-    if (resolvePath(fp, path, &parentInode, name) != -1) {
+    if (resolvePath(dev, path, &parentInode, name) != -1) {
         // File already exists at this path
         fprintf(stderr, "Error: File already exists.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
     // Check if the parent directory exists, resolvePath should find it
     if (parentInode == -1) {
         fprintf(stderr, "Error: Parent directory does not exist.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
-    // Allocate a new inode for the file
-    int newInode = allocInode(fp);
+    // Allocate a new inode for the file next to its directory's
+    int newInode = allocInodeNear(dev, parentInode);
     if (newInode == -1) {
         fprintf(stderr, "Error: No free inodes available.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
@@ -426,24 +774,25 @@ int create_fs(const char *path) {
     }
 
     // Write the new inode to disk
-    if (writeInode(fp, newInode, &fileInode) != 0) {
+    if (writeInode(dev, newInode, &fileInode) != 0) {
         fprintf(stderr, "Error: Failed to write file inode.\n");
         // Free the allocated inode since writing failed
-        freeInode(fp, newInode);
-        fclose(fp);
+        freeInode(dev, newInode);
+        closeDisk(dev);
         return -1;
     }
 
     // Add the new file entry to its parent directory
-    if (addDirEntry(fp, parentInode, name, newInode) != 0) {
+    if (addDirEntry(dev, parentInode, name, newInode) != 0) {
         fprintf(stderr, "Error: Failed to link file to parent directory.\n");
         //Free the allocated inode since linking failed
-        freeInode(fp, newInode);
-        fclose(fp);
+        freeInode(dev, newInode);
+        closeDisk(dev);
         return -1;
     }
+    chargeUsage(dev, parentInode, 0, 1);
 
-    fclose(fp);
+    closeDisk(dev);
     return 0;
 }
 
@@ -456,8 +805,8 @@ int mkdir_fs(const char *path) {
     }
 
     // Open the disk image file
-    FILE *fp = fopen("disk.img", "rb+");
-    if (!fp) {
+    BlockDevice *dev = openDisk(DISK_RDWR);
+    if (!dev) {
         fprintf(stderr, "Error: Could not open disk image.\n");
         return -1;
     }
@@ -467,35 +816,35 @@ int mkdir_fs(const char *path) {
     int parentInode = -1;
     char name[28];
     
-    if (resolvePath(fp, path, &parentInode, name) != -1) {
+    if (resolvePath(dev, path, &parentInode, name) != -1) {
         // Directory already exists at this path
         fprintf(stderr, "Error: Directory already exists.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
     // Check if the parent directory exists (resolvePath should have found it)
     if (parentInode == -1) {
         fprintf(stderr, "Error: Parent directory does not exist.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
     // Try to allocate a new inode for the directory
-    int newInode = allocInode(fp);
+    int newInode = allocInodeNear(dev, parentInode);
     if (newInode == -1) {
         fprintf(stderr, "Error: No free inodes available.\n");
-        fclose(fp);
+        closeDisk(dev);
         return -1;
     }
 
     // Try to allocate a data block for the new directory
-    int newBlock = allocDataBlock(fp);
+    int newBlock = allocDirBlock(dev, parentInode);
     if (newBlock == -1) {
         fprintf(stderr, "Error: No free data blocks available.\n");
         // Free the allocated inode since we couldn't get a data block
-        freeInode(fp, newInode);
-        fclose(fp);
+        freeInode(dev, newInode);
+        closeDisk(dev);
         return -1;
     }
 
@@ -513,12 +862,12 @@ int mkdir_fs(const char *path) {
     }
 
     // Write the directory inode to disk
-    if (writeInode(fp, newInode, &dirInode) != 0) {
+    if (writeInode(dev, newInode, &dirInode) != 0) {
         fprintf(stderr, "Error: Failed to write new directory inode.\n");
         // Clean up, free both allocated resources
-        freeDataBlock(fp, newBlock);
-        freeInode(fp, newInode);
-        fclose(fp);
+        freeDataBlock(dev, newBlock);
+        freeInode(dev, newInode);
+        closeDisk(dev);
         return -1;
     }
     
@@ -542,42 +891,93 @@ int mkdir_fs(const char *path) {
     selfAndParent[1].inode_number = parentInode;
 
     // Write the initial directory entries to the allocated data block
-    if (writeBlock(fp, newBlock, selfAndParent) != 0) {
+    if (writeBlock(dev, newBlock, selfAndParent) != 0) {
         fprintf(stderr, "Error: Failed to write initial directory entries.\n");
         // Clean up, free both allocated resources
-        freeDataBlock(fp, newBlock);
-        freeInode(fp, newInode);
-        fclose(fp);
+        freeDataBlock(dev, newBlock);
+        freeInode(dev, newInode);
+        closeDisk(dev);
         return -1;
     }
     
-    // Add the new directory entry to its parent directory
-    if (addDirEntry(fp, parentInode, name, newInode) != 0) {
+    // Add the new directory entry to its parent directory, with its usage
+    // starting from zero
+    resetUsage(dev, newInode);
+    if (addDirEntry(dev, parentInode, name, newInode) != 0) {
         fprintf(stderr, "Error: Failed to link directory to parent.\n");
         // Clean up, free both allocated resources
-        freeDataBlock(fp, newBlock);
-        freeInode(fp, newInode);
-        fclose(fp);
+        freeDataBlock(dev, newBlock);
+        freeInode(dev, newInode);
+        closeDisk(dev);
         return -1;
     }
+    chargeUsage(dev, parentInode, 0, 1);
 
-    fclose(fp);
+    closeDisk(dev);
     return 0;
 }
 
 
+// Path of file index of a striped volume, e.g. disk.img.2
+static void stripePath(char *out, size_t size, const char *diskfile, int index) {
+    snprintf(out, size, "%s.%d", diskfile, index);
+}
+
+static BlockDevice *openStripes(const char *diskfile, int files, int unit, int writable, int create) {
+    char paths[STRIPE_MAX_FILES][256];
+    const char *names[STRIPE_MAX_FILES];
+    if (files < 1 || files > STRIPE_MAX_FILES) return NULL;
+    for (int i = 0; i < files; i++) {
+        stripePath(paths[i], sizeof(paths[i]), diskfile, i);
+        names[i] = paths[i];
+    }
+    return bdev_open_stripe(names, files, unit, writable, create);
+}
+
 void mkfs(const char *diskfile) {
-    // Create/open the disk image file
-    FILE *fp = fopen(diskfile, "wb+");
-    if (!fp) {
+    // Create/open the disk image file, or the files of a striped volume. A
+    // single image of the same name would hide the volume, so it goes.
+    BlockDevice *dev;
+    if (mkfsStripeFiles > 1) {
+        unlink(diskfile);
+        dev = openStripes(diskfile, mkfsStripeFiles, mkfsStripeUnit, 1, 1);
+    } else {
+        dev = bdev_open_file(diskfile, 1, 1);
+    }
+    if (!dev) {
         fprintf(stderr, "Error: Unable to create disk image.\n");
         return;
     }
 
-    // Initialize the entire disk with zeros (1MB = 1024 blocks of 1KB each)
+    mkfs_dev(dev);
+    bdev_close(dev);
+}
+
+int mkfs_dev(BlockDevice *dev) {
+    if (dev->num_blocks < NUM_BLOCKS) {
+        fprintf(stderr, "Error: Device is too small.\n");
+        return -1;
+    }
+
+    // Initialize the entire disk with zeros (1MB = 1024 blocks of 1KB each),
+    // this also clears the checksum area so every block starts without one
+    diskFeatures = 0;
     char zero_block[BLOCK_SIZE] = {0};
     for (int i = 0; i < NUM_BLOCKS; i++) {
-        fwrite(zero_block, 1, BLOCK_SIZE, fp);
+        if (writeBlock(dev, i, zero_block) != 0) {
+            fprintf(stderr, "Error: Unable to write disk image.\n");
+            return -1;
+        }
+    }
+
+    // Changed blocks are tracked if the device has room for the generation
+    // table after the filesystem
+    int tracked = dev->num_blocks >= NUM_BLOCKS + (int)GEN_BLOCKS;
+    for (int i = 0; tracked && i < (int)GEN_BLOCKS; i++) {
+        if (dev->write(dev, GEN_START_BLOCK + i, 1, zero_block) != 0) {
+            fprintf(stderr, "Error: Unable to write disk image.\n");
+            return -1;
+        }
     }
 
     // Create and initialize the superblock with filesystem metadata
@@ -587,12 +987,24 @@ void mkfs(const char *diskfile) {
         .num_inodes = NUM_INODES, // Total number of inodes (512)
         .bitmap_start = BITMAP_BLOCK, // Bitmap for data block allocation
         .inode_start = INODE_START_BLOCK, // Start of inode table
-        .data_start = DATA_START_BLOCK // Start of data blocks
+        .data_start = DATA_START_BLOCK, // Start of data blocks
+        .features = FS_FEATURE_CSUM | FS_FEATURE_COUNTERS | (mkfsDataChecksums ? FS_FEATURE_CSUM_DATA : 0) |
+                    (tracked ? FS_FEATURE_CBT : 0),
+        .free_blocks = NUM_BLOCKS - DATA_START_BLOCK - 1, // All but the root directory's block
+        .free_inodes = NUM_INODES - 1, // All but the root directory
+        .generation = 1,
+        .stripe_count = mkfsStripeFiles > 1 ? mkfsStripeFiles : 0,
+        .stripe_unit = mkfsStripeFiles > 1 ? mkfsStripeUnit : 0,
+        .block_size = BLOCK_SIZE
     };
 
+    // Everything written from here on is checksummed
+    diskFeatures = sb.features;
+
     // Write the superblock to block 0
-    fseek(fp, 0, SEEK_SET);
-    fwrite(&sb, sizeof(SuperBlock), 1, fp);
+    char block[BLOCK_SIZE] = {0};
+    memcpy(block, &sb, sizeof(SuperBlock));
+    writeBlock(dev, 0, block);
 
     // Initialize the data block bitmap (block 1)
     char bitmap[BLOCK_SIZE] = {0};
@@ -604,16 +1016,9 @@ void mkfs(const char *diskfile) {
     bitmap[root_block_index / 8] |= (1 << (root_block_index % 8));
     
     // Write the bitmap to disk
-    fseek(fp, BLOCK_SIZE * sb.bitmap_start, SEEK_SET);
-    fwrite(bitmap, 1, BLOCK_SIZE, fp);
+    writeBlock(dev, sb.bitmap_start, bitmap);
 
-    // Initialize the inode table (blocks 2-10) with empty inodes
-    Inode inode;
-    memset(&inode, 0, sizeof(Inode));
-    fseek(fp, BLOCK_SIZE * sb.inode_start, SEEK_SET);
-    for (int i = 0; i < NUM_INODES; i++) {
-        fwrite(&inode, sizeof(Inode), 1, fp);
-    }
+    // The inode table (blocks 2-10) is already zeroed, so all inodes are empty
 
     // Initialize root directory as stated
     Inode root_inode = {
@@ -630,8 +1035,7 @@ void mkfs(const char *diskfile) {
     }
 
     // Write the root directory inode to position 0 in the inode table
-    fseek(fp, BLOCK_SIZE * sb.inode_start, SEEK_SET);
-    fwrite(&root_inode, sizeof(Inode), 1, fp);
+    writeInode(dev, 0, &root_inode);
 
     // Initialize root directory data block with empty entries
     DirectoryEntry root_entries[MAX_DIR_ENTRIES];
@@ -641,63 +1045,1067 @@ void mkfs(const char *diskfile) {
     }
     
     // Write the empty directory entries to the root directory's data block
-    fseek(fp, root_data_block * BLOCK_SIZE, SEEK_SET);
-    fwrite(root_entries, sizeof(root_entries), 1, fp);
-    
-    fclose(fp);
+    if (writeBlock(dev, root_data_block, root_entries) != 0) {
+        fprintf(stderr, "Error: Unable to write disk image.\n");
+        return -1;
+    }
+    flushGenerations(dev);
+    return dev->sync(dev);
 }
 
-// Read and write operations for blocks in the filesystem
-int readBlock(FILE *fp, int block_index, void *buf) {
-    fseek(fp, block_index * BLOCK_SIZE, SEEK_SET);
-    return fread(buf, 1, BLOCK_SIZE, fp) == BLOCK_SIZE ? 0 : -1;
+int statfs_fs(StatFs *out) {
+    if (!out) {
+        fprintf(stderr, "Error: Invalid arguments to statfs_fs.\n");
+        return -1;
+    }
+
+    // Open the disk image file for reading
+    BlockDevice *dev = openDisk(DISK_RDONLY);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    SuperBlock sb;
+    char block[BLOCK_SIZE];
+    if (readBlock(dev, 0, block) != 0) {
+        fprintf(stderr, "Error: Failed to read superblock.\n");
+        closeDisk(dev);
+        return -1;
+    }
+    memcpy(&sb, block, sizeof(SuperBlock));
+
+    out->block_size = BLOCK_SIZE;
+    out->total_blocks = NUM_BLOCKS - DATA_START_BLOCK;
+    out->total_inodes = NUM_INODES;
+    out->free_blocks = sb.free_blocks;
+    out->free_inodes = sb.free_inodes;
+
+    // Images made before the counters existed have to be counted
+    if (!(sb.features & FS_FEATURE_COUNTERS)) {
+        uint8_t bitmap[BLOCK_SIZE];
+        Inode inode;
+        out->free_blocks = out->free_inodes = 0;
+        if (readBlock(dev, BITMAP_BLOCK, bitmap) != 0) {
+            closeDisk(dev);
+            return -1;
+        }
+        for (int b = DATA_START_BLOCK; b < NUM_BLOCKS; b++) {
+            if (!bitmapTest(bitmap, b)) out->free_blocks++;
+        }
+        for (int i = 0; i < NUM_INODES; i++) {
+            if (readInode(dev, i, &inode) == 0 && !inode.is_valid) out->free_inodes++;
+        }
+    }
+
+    closeDisk(dev);
+    return 0;
 }
 
-int writeBlock(FILE *fp, int block_index, const void *buf) {
-    fseek(fp, block_index * BLOCK_SIZE, SEEK_SET);
-    return fwrite(buf, 1, BLOCK_SIZE, fp) == BLOCK_SIZE ? 0 : -1;
+int dirusage_fs(const char *path, DirUsage *out) {
+    if (!path || path[0] != '/' || !out) {
+        fprintf(stderr, "Error: Only absolute paths are supported.\n");
+        return -1;
+    }
+
+    // Open the disk image file for reading
+    BlockDevice *dev = openDisk(DISK_RDONLY);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    if (!(diskFeatures & FS_FEATURE_COUNTERS)) {
+        fprintf(stderr, "Error: Disk image does not track directory usage.\n");
+        closeDisk(dev);
+        return -1;
+    }
+
+    Inode dirInode;
+    int dirInodeIndex = resolvePath(dev, path, NULL, NULL);
+    if (dirInodeIndex == -1 || readInode(dev, dirInodeIndex, &dirInode) != 0 || !dirInode.is_directory ||
+        readUsage(dev, dirInodeIndex, out) != 0) {
+        fprintf(stderr, "Error: Directory not found.\n");
+        closeDisk(dev);
+        return -1;
+    }
+
+    closeDisk(dev);
+    return 0;
+}
+
+// Image used by operations while nothing is mounted
+static char imagePath[256] = "disk.img";
+
+// Device shared by all operations while mounted, NULL when every call opens
+// the image itself. Operations on a mounted device are serialized by fsLock.
+static BlockDevice *mountedDev = NULL;
+static int ownsMountedDev = 0;
+static pthread_mutex_t fsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Block cache used while a device is mounted, direct mapped by block index.
+// With writeback on, writes only dirty the cache and a flusher thread writes
+// them to the device later, otherwise the cache is write-through.
+#define CACHE_BLOCKS 256
+
+typedef struct {
+    int block; // Cached block index, -1 if the slot is empty
+    int dirty; // Newer than the device
+    int writeback; // Being written to the device by a writeback pass
+    long dirtySince; // When the block became dirty, in ms
+    char data[BLOCK_SIZE];
+} CacheEntry;
+
+static CacheEntry *cache = NULL;
+static unsigned long cacheHits = 0;
+static unsigned long cacheMisses = 0;
+
+// Only operations, which fsLock serializes, change the block a slot holds
+// or its data. Writeback passes copy the data out and flip the dirty and
+// writeback flags, so those and the dirty data are guarded by cacheLock.
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writebackDone = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flusherWake = PTHREAD_COND_INITIALIZER;
+// Off unless asked for: until the flusher runs, a completed write exists
+// only in memory
+static WritebackTunables tunables = {
+    .enabled = 0,
+    .interval_ms = 100,
+    .expire_ms = 500,
+    .background_ratio = 10,
+    .dirty_ratio = 20
+};
+static WritebackStats wbStats;
+static int writebackOn = 0; // Tunables in effect for the mounted device
+static int dirtyCount = 0;
+static int inFlight = 0; // Blocks being written by writeback passes
+static pthread_t flusher;
+static int flusherRunning = 0;
+static int flusherStop = 0;
+
+static void startFlusher(BlockDevice *dev);
+static void stopFlusher(void);
+
+void fs_set_image(const char *diskfile) {
+    strncpy(imagePath, diskfile, sizeof(imagePath) - 1);
+    imagePath[sizeof(imagePath) - 1] = '\0';
+}
+
+const char *fs_image(void) {
+    return imagePath;
+}
+
+void fs_set_data_checksums(int enabled) {
+    mkfsDataChecksums = enabled;
+}
+
+int fs_set_stripes(int files, int unit) {
+    if (files < 1 || files > STRIPE_MAX_FILES || unit < 1) {
+        fprintf(stderr, "Error: Stripes need 1 to %d files and a unit of at least 1 block.\n", STRIPE_MAX_FILES);
+        return -1;
+    }
+    mkfsStripeFiles = files;
+    mkfsStripeUnit = unit;
+    return 0;
+}
+
+void fs_set_direct_io(int enabled) {
+    directIo = enabled;
+}
+
+// A single image file if there is one, otherwise a striped volume. Block 0
+// is at the start of the first file, so its superblock tells how many files
+// there are and how they are striped.
+BlockDevice *openImage(const char *diskfile, int writable) {
+    if (access(diskfile, F_OK) == 0 && directIo) {
+        BlockDevice *dev = bdev_open_direct(diskfile, writable);
+        if (!dev) fprintf(stderr, "Error: Direct I/O is not available for %s.\n", diskfile);
+        return dev;
+    }
+    if (access(diskfile, F_OK) == 0) return bdev_open_file(diskfile, writable, 0);
+
+    char first[256];
+    stripePath(first, sizeof(first), diskfile, 0);
+    BlockDevice *dev = bdev_open_file(first, 0, 0);
+    if (!dev) return NULL;
+
+    SuperBlock sb;
+    char block[BLOCK_SIZE];
+    int rc = dev->read(dev, 0, 1, block);
+    bdev_close(dev);
+    memcpy(&sb, block, sizeof(SuperBlock));
+    if (rc != 0 || sb.magic_number != MAGIC_NUMBER || sb.stripe_count < 1) return NULL;
+    return openStripes(diskfile, sb.stripe_count, sb.stripe_unit, writable, 0);
+}
+
+// Images record the block size they were made with, one made by a build with
+// another BLOCK_SIZE would be read at the wrong offsets
+static int sameBlockSize(const SuperBlock *sb) {
+    if (sb->magic_number != MAGIC_NUMBER || sb->block_size == 0 || sb->block_size == BLOCK_SIZE) return 1;
+    fprintf(stderr, "Error: Image has %d byte blocks, this build uses %d.\n", sb->block_size, BLOCK_SIZE);
+    return 0;
+}
+
+// Reads the feature flags straight from the device, the superblock's own
+// checksum cannot be verified before they are known
+static int loadFeatures(BlockDevice *dev) {
+    SuperBlock sb;
+    char block[BLOCK_SIZE];
+    if (dev->read(dev, 0, 1, block) != 0) return -1;
+    memcpy(&sb, block, sizeof(SuperBlock));
+    if (!sameBlockSize(&sb)) return -1;
+    diskFeatures = (sb.magic_number == MAGIC_NUMBER) ? sb.features : 0;
+    return 0;
+}
+
+int mount_dev(BlockDevice *dev) {
+    if (mountedDev) {
+        fprintf(stderr, "Error: An image is already mounted.\n");
+        return -1;
+    }
+
+    // Refuse anything that was not formatted by mkfs
+    SuperBlock sb;
+    char block[BLOCK_SIZE];
+    if (dev->read(dev, 0, 1, block) != 0) {
+        fprintf(stderr, "Error: Could not read disk image.\n");
+        return -1;
+    }
+    memcpy(&sb, block, sizeof(SuperBlock));
+    if (sb.magic_number != MAGIC_NUMBER) {
+        fprintf(stderr, "Error: Not a MiniFS disk image.\n");
+        return -1;
+    }
+    if (!sameBlockSize(&sb)) return -1;
+    diskFeatures = sb.features;
+
+    cache = malloc(CACHE_BLOCKS * sizeof(CacheEntry));
+    if (!cache) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        return -1;
+    }
+    for (int i = 0; i < CACHE_BLOCKS; i++) {
+        cache[i].block = -1;
+        cache[i].dirty = cache[i].writeback = 0;
+    }
+    cacheHits = cacheMisses = 0;
+    memset(&wbStats, 0, sizeof(wbStats));
+    dirtyCount = inFlight = 0;
+
+    mountedDev = dev;
+    ownsMountedDev = 0;
+    writebackOn = tunables.enabled;
+    if (writebackOn) startFlusher(dev);
+    return 0;
+}
+
+int mount_fs(const char *diskfile) {
+    BlockDevice *dev = openImage(diskfile, 1);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+    if (mount_dev(dev) != 0) {
+        bdev_close(dev);
+        return -1;
+    }
+    ownsMountedDev = 1;
+    return 0;
+}
+
+void unmount_fs(void) {
+    pthread_mutex_lock(&fsLock);
+    if (mountedDev) {
+        // Everything still dirty goes out before the device is synced
+        stopFlusher();
+        flushCache(mountedDev);
+        writebackOn = 0;
+        mountedDev->sync(mountedDev);
+        if (ownsMountedDev) bdev_close(mountedDev);
+        mountedDev = NULL;
+        free(cache);
+        cache = NULL;
+        diskFeatures = 0;
+    }
+    pthread_mutex_unlock(&fsLock);
+}
+
+void fs_cache_stats(unsigned long *hits, unsigned long *misses) {
+    pthread_mutex_lock(&fsLock);
+    if (hits) *hits = cacheHits;
+    if (misses) *misses = cacheMisses;
+    pthread_mutex_unlock(&fsLock);
+}
+
+// Every operation gets its device through openDisk and hands it back with
+// closeDisk, which either reuses the mounted device or opens the image
+BlockDevice *openDisk(int writable) {
+    if (mountedDev) {
+        pthread_mutex_lock(&fsLock);
+        return mountedDev;
+    }
+    BlockDevice *dev = openImage(imagePath, writable);
+    if (dev && loadFeatures(dev) != 0) {
+        bdev_close(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+static void flushFreeCounts(BlockDevice *dev);
+static void discardFreedBlocks(BlockDevice *dev);
+
+void closeDisk(BlockDevice *dev) {
+    if (dev) {
+        flushFreeCounts(dev);
+        discardFreedBlocks(dev);
+        flushGenerations(dev);
+    }
+    if (dev && dev == mountedDev) {
+        pthread_mutex_unlock(&fsLock);
+        return;
+    }
+    bdev_close(dev);
+}
+
+static CacheEntry *cacheSlot(BlockDevice *dev, int block_index) {
+    if (!cache || dev != mountedDev || block_index < 0) return NULL;
+    return &cache[block_index % CACHE_BLOCKS];
+}
+
+static long nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static int dirtyLimit(int ratio) {
+    int limit = CACHE_BLOCKS * ratio / 100;
+    return limit > 0 ? limit : 1;
+}
+
+static char *copyOf(char **copy, int i) {
+    return copy[i / BDEV_BUF_BLOCKS] + (size_t)(i % BDEV_BUF_BLOCKS) * BLOCK_SIZE;
+}
+
+static int compareBlocks(const void *a, const void *b) {
+    return (*(CacheEntry *const *)a)->block - (*(CacheEntry *const *)b)->block;
+}
+
+// Pool buffers a writeback pass copies the whole cache into
+#define WRITEBACK_BUFS ((CACHE_BLOCKS + BDEV_BUF_BLOCKS - 1) / BDEV_BUF_BLOCKS)
+
+// Writes back dirty blocks, all of them or those dirty for at least
+// expire_ms, with one device write per run of consecutive blocks. The data is
+// copied out first, so operations can keep changing the blocks while the
+// writes are in progress. The copies go in pool buffers, which direct I/O
+// can write without bouncing, and a run ends where a buffer does. Returns -1
+// if a write failed.
+static int writebackPass(BlockDevice *dev, int all) {
+    CacheEntry *picked[CACHE_BLOCKS];
+    char *copy[WRITEBACK_BUFS] = {0};
+
+    pthread_mutex_lock(&cacheLock);
+    long now = nowMs();
+    int n = 0;
+    for (int i = 0; i < CACHE_BLOCKS; i++) {
+        CacheEntry *slot = &cache[i];
+        if (!slot->dirty || slot->writeback) continue;
+        if (!all && now - slot->dirtySince < tunables.expire_ms) continue;
+        picked[n++] = slot;
+    }
+    for (int k = 0; k * BDEV_BUF_BLOCKS < n; k++) {
+        copy[k] = bdev_buf_get();
+        if (!copy[k]) {
+            pthread_mutex_unlock(&cacheLock);
+            for (int j = 0; j < k; j++) bdev_buf_put(copy[j]);
+            return -1;
+        }
+    }
+    qsort(picked, n, sizeof(picked[0]), compareBlocks);
+    for (int i = 0; i < n; i++) {
+        memcpy(copyOf(copy, i), picked[i]->data, BLOCK_SIZE);
+        picked[i]->dirty = 0;
+        picked[i]->writeback = 1;
+    }
+    dirtyCount -= n;
+    inFlight += n;
+    pthread_mutex_unlock(&cacheLock);
+
+    int rc = 0;
+    int writes = 0;
+    int failedFrom = n;
+    for (int i = 0; i < n && rc == 0;) {
+        int run = 1;
+        while (i + run < n && (i + run) % BDEV_BUF_BLOCKS != 0 &&
+               picked[i + run]->block == picked[i]->block + run) run++;
+        rc = dev->write(dev, picked[i]->block, run, copyOf(copy, i));
+        if (rc != 0) failedFrom = i;
+        writes++;
+        i += run;
+    }
+
+    // Blocks that did not make it are dirty again, unless an operation
+    // already dirtied them anew
+    pthread_mutex_lock(&cacheLock);
+    for (int i = 0; i < n; i++) {
+        picked[i]->writeback = 0;
+        if (i >= failedFrom && !picked[i]->dirty) {
+            picked[i]->dirty = 1;
+            dirtyCount++;
+        }
+    }
+    inFlight -= n;
+    wbStats.flushed_blocks += failedFrom;
+    wbStats.flush_writes += writes;
+    pthread_cond_broadcast(&writebackDone);
+    pthread_mutex_unlock(&cacheLock);
+    for (int k = 0; k < WRITEBACK_BUFS; k++) bdev_buf_put(copy[k]);
+    return rc;
+}
+
+static void *flusherMain(void *arg) {
+    BlockDevice *dev = arg;
+    pthread_mutex_lock(&cacheLock);
+    while (!flusherStop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += (tunables.interval_ms % 1000) * 1000000L;
+        until.tv_sec += tunables.interval_ms / 1000 + until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&flusherWake, &cacheLock, &until);
+        if (flusherStop) break;
+
+        // Past the background ratio everything goes, otherwise only what has
+        // been dirty for long enough
+        int all = dirtyCount >= dirtyLimit(tunables.background_ratio);
+        if (dirtyCount == 0) continue;
+        wbStats.flusher_passes++;
+        pthread_mutex_unlock(&cacheLock);
+        writebackPass(dev, all);
+        pthread_mutex_lock(&cacheLock);
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return NULL;
+}
+
+static void startFlusher(BlockDevice *dev) {
+    flusherStop = 0;
+    flusherRunning = pthread_create(&flusher, NULL, flusherMain, dev) == 0;
+    if (!flusherRunning) writebackOn = 0;
+}
+
+static void stopFlusher(void) {
+    if (!flusherRunning) return;
+    pthread_mutex_lock(&cacheLock);
+    flusherStop = 1;
+    pthread_cond_signal(&flusherWake);
+    pthread_mutex_unlock(&cacheLock);
+    pthread_join(flusher, NULL);
+    flusherRunning = 0;
+}
+
+// Makes the device current for cached blocks that are about to be accessed
+// on it directly: waits for their writeback and, with write set, writes them
+// if still dirty. Without write a dirty copy is simply forgotten, for blocks
+// about to be overwritten. With drop set the cached copies go as well.
+static int settleCached(BlockDevice *dev, int first_block, int count, int write, int drop) {
+    int rc = 0;
+    for (int i = 0; i < count; i++) {
+        CacheEntry *slot = cacheSlot(dev, first_block + i);
+        if (!slot || slot->block != first_block + i) continue;
+
+        pthread_mutex_lock(&cacheLock);
+        while (slot->writeback) pthread_cond_wait(&writebackDone, &cacheLock);
+        if (slot->dirty && write && dev->write(dev, slot->block, 1, slot->data) != 0) {
+            rc = -1;
+        } else if (slot->dirty) {
+            slot->dirty = 0;
+            dirtyCount--;
+        }
+        if (drop && rc == 0) slot->block = -1;
+        pthread_mutex_unlock(&cacheLock);
+    }
+    return rc;
+}
+
+static void dropCached(BlockDevice *dev, int first_block, int count) {
+    settleCached(dev, first_block, count, 0, 1);
+}
+
+int flushCache(BlockDevice *dev) {
+    if (!cache || dev != mountedDev) return 0;
+    int rc = writebackPass(dev, 1);
+    pthread_mutex_lock(&cacheLock);
+    while (inFlight > 0) pthread_cond_wait(&writebackDone, &cacheLock);
+    pthread_mutex_unlock(&cacheLock);
+    return rc;
+}
+
+// Slot about to hold another block: the block in it has to reach the device
+// first if it is dirty
+static int evictSlot(BlockDevice *dev, CacheEntry *slot) {
+    if (slot->block == -1) return 0;
+    return settleCached(dev, slot->block, 1, 1, 1);
+}
+
+// A write that dirties the cache. Writers that push the dirty blocks past
+// dirty_ratio write them all back themselves, which bounds the memory held
+// dirty and slows down whoever is producing them.
+static int writeCached(BlockDevice *dev, CacheEntry *slot, int block_index, const void *buf) {
+    if (slot->block != block_index) {
+        if (evictSlot(dev, slot) != 0) return -1;
+        slot->block = block_index;
+    }
+
+    pthread_mutex_lock(&cacheLock);
+    memcpy(slot->data, buf, BLOCK_SIZE);
+    if (!slot->dirty) {
+        slot->dirty = 1;
+        slot->dirtySince = nowMs();
+        dirtyCount++;
+    }
+    int throttle = dirtyCount >= dirtyLimit(tunables.dirty_ratio);
+    if (dirtyCount >= dirtyLimit(tunables.background_ratio)) pthread_cond_signal(&flusherWake);
+    if (throttle) wbStats.throttled++;
+    pthread_mutex_unlock(&cacheLock);
+
+    return throttle ? writebackPass(dev, 1) : 0;
+}
+
+int fs_set_writeback(const WritebackTunables *t) {
+    if (!t || t->interval_ms < 1 || t->expire_ms < 0 || t->background_ratio < 0 ||
+        t->dirty_ratio < t->background_ratio || t->dirty_ratio > 100) {
+        fprintf(stderr, "Error: Invalid writeback tunables.\n");
+        return -1;
+    }
+    pthread_mutex_lock(&cacheLock);
+    tunables = *t;
+    pthread_mutex_unlock(&cacheLock);
+    return 0;
+}
+
+void fs_writeback_stats(WritebackStats *out) {
+    pthread_mutex_lock(&cacheLock);
+    *out = wbStats;
+    out->dirty_blocks = dirtyCount;
+    pthread_mutex_unlock(&cacheLock);
+}
+
+// Checksums are never 0 when stored, so that 0 can mark a block without one
+uint32_t blockChecksum(const void *buf) {
+    uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+    return crc ? crc : 1;
+}
+
+static int isChecksumBlock(int block_index) {
+    return block_index >= CSUM_START_BLOCK && block_index < CSUM_START_BLOCK + (int)CSUM_BLOCKS;
+}
+
+static int checksummed(int block_index) {
+    return (diskFeatures & FS_FEATURE_CSUM) && !isChecksumBlock(block_index);
+}
+
+static int loadChecksum(BlockDevice *dev, int block_index, uint32_t *out) {
+    uint32_t table[CSUMS_PER_BLOCK];
+    if (readBlock(dev, CSUM_START_BLOCK + block_index / CSUMS_PER_BLOCK, table) != 0) return -1;
+    *out = table[block_index % CSUMS_PER_BLOCK];
+    return 0;
+}
+
+// Records the checksums of count blocks, or clears them if sums is NULL,
+// writing each checksum block touched once
+static int storeChecksums(BlockDevice *dev, int first_block, int count, const uint32_t *sums) {
+    uint32_t table[CSUMS_PER_BLOCK];
+    for (int i = 0; i < count;) {
+        int b = first_block + i;
+        int csumBlock = CSUM_START_BLOCK + b / CSUMS_PER_BLOCK;
+        if (readBlock(dev, csumBlock, table) != 0) return -1;
+        for (; i < count && CSUM_START_BLOCK + (first_block + i) / CSUMS_PER_BLOCK == csumBlock; i++) {
+            table[(first_block + i) % CSUMS_PER_BLOCK] = sums ? sums[i] : 0;
+        }
+        if (writeBlock(dev, csumBlock, table) != 0) return -1;
+    }
+    return 0;
+}
+
+static int checkBlock(int block_index, uint32_t stored, uint32_t actual) {
+    if (stored == 0 || stored == actual) return 0;
+    fprintf(stderr, "Error: Checksum mismatch in block %d.\n", block_index);
+    return -1;
+}
+
+static int verifyBlocks(BlockDevice *dev, int first_block, const void *buf, int count) {
+    for (int i = 0; i < count; i++) {
+        uint32_t stored;
+        if (!checksummed(first_block + i)) continue;
+        if (loadChecksum(dev, first_block + i, &stored) != 0) return -1;
+        if (checkBlock(first_block + i, stored, blockChecksum((const char *)buf + i * BLOCK_SIZE)) != 0) return -1;
+    }
+    return 0;
+}
+
+// Checksums blocks written by the multi-block and vectored paths, which carry
+// file data: real checksums if the image covers data, otherwise none
+static int storeDataChecksums(BlockDevice *dev, int first_block, int count, const struct iovec *iov, int iovcnt) {
+    if (!checksummed(first_block)) return 0;
+    if (!(diskFeatures & FS_FEATURE_CSUM_DATA)) return storeChecksums(dev, first_block, count, NULL);
+
+    // CRC the buffers block by block, a block spread over several buffers is
+    // continued across them. A trailing partial block gets no checksum.
+    uint32_t sums[CSUMS_PER_BLOCK];
+    int b = 0;
+    int batch = 0;
+    size_t filled = 0;
+    uint32_t crc = 0;
+    for (int i = 0; i < iovcnt && b < count; i++) {
+        const char *p = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0 && b < count) {
+            size_t n = BLOCK_SIZE - filled < left ? BLOCK_SIZE - filled : left;
+            crc = crc32c(crc, p, n);
+            p += n;
+            left -= n;
+            filled += n;
+            if (filled < BLOCK_SIZE) continue;
+            sums[b++ - batch] = crc ? crc : 1;
+            crc = 0;
+            filled = 0;
+            if (b - batch == (int)CSUMS_PER_BLOCK) {
+                if (storeChecksums(dev, first_block + batch, b - batch, sums) != 0) return -1;
+                batch = b;
+            }
+        }
+    }
+    while (b < count) sums[b++ - batch] = 0;
+    return b > batch ? storeChecksums(dev, first_block + batch, b - batch, sums) : 0;
+}
+
+// Blocks written by the operation in progress. closeDisk stamps them with the
+// current generation, writing each generation table block touched once.
+static uint8_t changedBlocks[(NUM_BLOCKS + 7) / 8];
+static int changedCount = 0;
+
+static void markChanged(int first_block, int count) {
+    if (!(diskFeatures & FS_FEATURE_CBT)) return;
+    for (int b = first_block; b < first_block + count && b < NUM_BLOCKS; b++) {
+        changedBlocks[b / 8] |= 1 << (b % 8);
+        changedCount++;
+    }
+}
+
+// The table lives outside the filesystem, so it goes straight to the device
+// without checksums or the cache
+static void flushGenerations(BlockDevice *dev) {
+    if (changedCount == 0) return;
+
+    SuperBlock sb;
+    char block[BLOCK_SIZE];
+    uint32_t gens[GENS_PER_BLOCK];
+    if (readBlock(dev, 0, block) == 0) {
+        memcpy(&sb, block, sizeof(SuperBlock));
+        for (int t = 0; t < (int)GEN_BLOCKS; t++) {
+            int first = t * GENS_PER_BLOCK;
+            int dirty = 0;
+            for (int b = first; b < first + (int)GENS_PER_BLOCK && b < NUM_BLOCKS; b++) {
+                if (changedBlocks[b / 8] & (1 << (b % 8))) dirty = 1;
+            }
+            if (!dirty || dev->read(dev, GEN_START_BLOCK + t, 1, gens) != 0) continue;
+            for (int b = first; b < first + (int)GENS_PER_BLOCK && b < NUM_BLOCKS; b++) {
+                if (changedBlocks[b / 8] & (1 << (b % 8))) gens[b - first] = sb.generation;
+            }
+            dev->write(dev, GEN_START_BLOCK + t, 1, gens);
+        }
+    }
+    memset(changedBlocks, 0, sizeof(changedBlocks));
+    changedCount = 0;
+}
+
+// Read and write operations for blocks in the filesystem. Blocks are
+// verified when they are read from the device, so a cached block is checked
+// once rather than on every access.
+int readBlock(BlockDevice *dev, int block_index, void *buf) {
+    CacheEntry *slot = cacheSlot(dev, block_index);
+    if (slot && slot->block == block_index) {
+        cacheHits++;
+        memcpy(buf, slot->data, BLOCK_SIZE);
+        return 0;
+    }
+
+    if (dev->read(dev, block_index, 1, buf) != 0) return -1;
+    if (verifyBlocks(dev, block_index, buf, 1) != 0) return -1;
+
+    // Verifying may have loaded a checksum block into the same slot, so the
+    // slot is only claimed now
+    if (slot) {
+        cacheMisses++;
+        if (evictSlot(dev, slot) != 0) return 0;
+        memcpy(slot->data, buf, BLOCK_SIZE);
+        slot->block = block_index;
+    }
+    return 0;
+}
+
+// The checksum is recorded after the block is written, a crash in between
+// shows up as a mismatch rather than going unnoticed. With writeback on the
+// block, and its checksum, only go to the cache here.
+int writeBlock(BlockDevice *dev, int block_index, const void *buf) {
+    CacheEntry *slot = cacheSlot(dev, block_index);
+
+    if (slot && writebackOn) {
+        if (writeCached(dev, slot, block_index, buf) != 0) return -1;
+    } else if (dev->write(dev, block_index, 1, buf) != 0) {
+        if (slot && slot->block == block_index) slot->block = -1;
+        return -1;
+    } else if (slot) {
+        if (evictSlot(dev, slot) != 0) return -1;
+        memcpy(slot->data, buf, BLOCK_SIZE);
+        slot->block = block_index;
+    }
+    markChanged(block_index, 1);
+
+    if (checksummed(block_index)) {
+        uint32_t sum = blockChecksum(buf);
+        return storeChecksums(dev, block_index, 1, &sum);
+    }
+    return 0;
+}
+
+// Multi-block variants for runs of consecutive blocks, a single device
+// transfer when the cache is not in use
+int readBlocks(BlockDevice *dev, int first_block, void *buf, int count) {
+    if (cacheSlot(dev, first_block)) {
+        for (int i = 0; i < count; i++) {
+            if (readBlock(dev, first_block + i, (char *)buf + i * BLOCK_SIZE) != 0) return -1;
+        }
+        return 0;
+    }
+    if (dev->read(dev, first_block, count, buf) != 0) return -1;
+    return verifyBlocks(dev, first_block, buf, count);
+}
+
+static int iovBlocks(const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    return (int)((total + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
+
+// Vectored variants moving data directly between caller buffers and a run of
+// consecutive blocks. Reads go straight to the device once any dirty cached
+// copies are written back; writes replace the cached copies.
+// With checksums on, a read ending part way into a block is extended to the
+// end of that block so the whole block can be verified.
+int readBlocksv(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt) {
+    if (settleCached(dev, first_block, iovBlocks(iov, iovcnt), 1, 0) != 0) return -1;
+    if (!checksummed(first_block)) return dev->readv(dev, first_block, iov, iovcnt);
+
+    char tail[BLOCK_SIZE];
+    struct iovec full[BDEV_IOV_MAX];
+    if (iovcnt >= BDEV_IOV_MAX) return -1;
+    memcpy(full, iov, iovcnt * sizeof(struct iovec));
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    int count = (int)((total + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    int n = iovcnt;
+    if (total % BLOCK_SIZE != 0) {
+        full[n].iov_base = tail;
+        full[n].iov_len = BLOCK_SIZE - total % BLOCK_SIZE;
+        n++;
+    }
+    if (dev->readv(dev, first_block, full, n) != 0) return -1;
+
+    // Same block by block CRC as on the write side
+    int b = 0;
+    size_t filled = 0;
+    uint32_t crc = 0;
+    for (int i = 0; i < n; i++) {
+        const char *p = full[i].iov_base;
+        size_t left = full[i].iov_len;
+        while (left > 0) {
+            size_t len = BLOCK_SIZE - filled < left ? BLOCK_SIZE - filled : left;
+            crc = crc32c(crc, p, len);
+            p += len;
+            left -= len;
+            filled += len;
+            if (filled == BLOCK_SIZE) {
+                uint32_t stored;
+                if (loadChecksum(dev, first_block + b, &stored) != 0) return -1;
+                if (checkBlock(first_block + b, stored, crc ? crc : 1) != 0) return -1;
+                b++;
+                crc = 0;
+                filled = 0;
+            }
+        }
+    }
+    return b == count ? 0 : -1;
+}
+
+int writeBlocksv(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    int count = iovBlocks(iov, iovcnt);
+
+    // Drop cached copies of the blocks first, so no writeback can land on top
+    // of the new data. They are reloaded on demand. A partly written last
+    // block keeps the rest of its cached contents.
+    if (total % BLOCK_SIZE != 0 && settleCached(dev, first_block + count - 1, 1, 1, 0) != 0) return -1;
+    dropCached(dev, first_block, count);
+    int rc = dev->writev(dev, first_block, iov, iovcnt);
+    markChanged(first_block, count);
+    if (rc == 0) rc = storeDataChecksums(dev, first_block, count, iov, iovcnt);
+    return rc;
+}
+
+int writeBlocks(BlockDevice *dev, int first_block, const void *buf, int count) {
+    // Cached copies are replaced by the data written, which makes them clean
+    settleCached(dev, first_block, count, 0, 0);
+    int rc = dev->write(dev, first_block, count, buf);
+    for (int i = 0; i < count; i++) {
+        CacheEntry *slot = cacheSlot(dev, first_block + i);
+        if (!slot || slot->block != first_block + i) continue;
+        if (rc == 0) memcpy(slot->data, (const char *)buf + i * BLOCK_SIZE, BLOCK_SIZE);
+        else slot->block = -1;
+    }
+
+    markChanged(first_block, count);
+
+    struct iovec whole = { .iov_base = (void *)buf, .iov_len = (size_t)count * BLOCK_SIZE };
+    if (rc == 0) rc = storeDataChecksums(dev, first_block, count, &whole, 1);
+    return rc;
+}
+
+// Bitmap helpers, bit i of the bitmap block describes block DATA_START_BLOCK + i
+int bitmapTest(const uint8_t *bitmap, int block_index) {
+    int rel = block_index - DATA_START_BLOCK;
+    return (bitmap[rel / 8] >> (rel % 8)) & 1;
+}
+
+void bitmapSet(uint8_t *bitmap, int block_index) {
+    int rel = block_index - DATA_START_BLOCK;
+    bitmap[rel / 8] |= (1 << (rel % 8));
+}
+
+void bitmapClear(uint8_t *bitmap, int block_index) {
+    int rel = block_index - DATA_START_BLOCK;
+    bitmap[rel / 8] &= ~(1 << (rel % 8));
 }
 
 // Allocates data blocks in the filesystem 
-int allocDataBlock(FILE *fp) {
+int allocDataBlock(BlockDevice *dev) {
     uint8_t bitmap[BLOCK_SIZE];
-    fseek(fp, BITMAP_BLOCK * BLOCK_SIZE, SEEK_SET);
-    fread(bitmap, 1, BLOCK_SIZE, fp);
+    if (readBlock(dev, BITMAP_BLOCK, bitmap) != 0) return -1;
 
-    for (int i = 0; i < 1013; ++i) { // 1024 - 11 data blocks
+    for (int i = 0; i < NUM_BLOCKS - DATA_START_BLOCK; ++i) {
         int byte = i / 8;
         int bit = i % 8;
         if (!(bitmap[byte] & (1 << bit))) {
             bitmap[byte] |= (1 << bit);
-            fseek(fp, BITMAP_BLOCK * BLOCK_SIZE, SEEK_SET);
-            fwrite(bitmap, 1, BLOCK_SIZE, fp);
+            if (writeBlock(dev, BITMAP_BLOCK, bitmap) != 0) return -1;
+            countFree(-1, 0);
             return DATA_START_BLOCK + i;
         }
     }
     return -1;
 }
 
+static int allocPolicy = ALLOC_LOCALITY;
+
+void fs_set_alloc_policy(int policy) {
+    allocPolicy = policy;
+}
+
+// First free block in [from, to), or -1
+static int firstFreeBlock(const uint8_t *bitmap, int from, int to) {
+    for (int b = from; b < to; b++) {
+        if (!bitmapTest(bitmap, b)) return b;
+    }
+    return -1;
+}
+
+static int groupStart(int group) {
+    return DATA_START_BLOCK + group * BLOCK_GROUP_SIZE;
+}
+
+static int groupEnd(int group) {
+    int end = groupStart(group) + BLOCK_GROUP_SIZE;
+    return end < NUM_BLOCKS ? end : NUM_BLOCKS;
+}
+
+// Allocates a data block close to goal: the first free block from goal to the
+// end of its group, then the rest of that group, then the following groups in
+// turn. Without a goal, or under ALLOC_FIRST_FIT, this is allocDataBlock.
+int allocDataBlockNear(BlockDevice *dev, int goal) {
+    if (allocPolicy == ALLOC_FIRST_FIT || goal < DATA_START_BLOCK || goal >= NUM_BLOCKS) {
+        return allocDataBlock(dev);
+    }
+
+    uint8_t bitmap[BLOCK_SIZE];
+    if (readBlock(dev, BITMAP_BLOCK, bitmap) != 0) return -1;
+
+    int group = BLOCK_GROUP(goal);
+    int blk = firstFreeBlock(bitmap, goal, groupEnd(group));
+    if (blk == -1) blk = firstFreeBlock(bitmap, groupStart(group), goal);
+    for (int g = 1; blk == -1 && g < NUM_BLOCK_GROUPS; g++) {
+        int next = (group + g) % NUM_BLOCK_GROUPS;
+        blk = firstFreeBlock(bitmap, groupStart(next), groupEnd(next));
+    }
+    if (blk == -1) return -1;
+
+    bitmapSet(bitmap, blk);
+    if (writeBlock(dev, BITMAP_BLOCK, bitmap) != 0) return -1;
+    countFree(-1, 0);
+    return blk;
+}
+
+// Allocates the first block of a new directory. Top-level directories go to
+// the group with the most free blocks so that unrelated trees spread over the
+// disk, deeper ones stay next to their parent.
+int allocDirBlock(BlockDevice *dev, int parent_inode) {
+    if (allocPolicy == ALLOC_FIRST_FIT) return allocDataBlock(dev);
+
+    if (parent_inode != 0) {
+        Inode parent;
+        if (readInode(dev, parent_inode, &parent) != 0) return -1;
+        return allocDataBlockNear(dev, parent.direct_blocks[0]);
+    }
+
+    uint8_t bitmap[BLOCK_SIZE];
+    if (readBlock(dev, BITMAP_BLOCK, bitmap) != 0) return -1;
+
+    int best = 0;
+    int bestFree = -1;
+    for (int g = 0; g < NUM_BLOCK_GROUPS; g++) {
+        int freeBlocks = 0;
+        for (int b = groupStart(g); b < groupEnd(g); b++) {
+            if (!bitmapTest(bitmap, b)) freeBlocks++;
+        }
+        if (freeBlocks > bestFree) {
+            best = g;
+            bestFree = freeBlocks;
+        }
+    }
+    return allocDataBlockNear(dev, groupStart(best));
+}
+
+// Blocks freed by the operation in progress. With discard on, closeDisk
+// hands them back to the device in one batch at the end of the operation.
+static int discardOnFree = 0;
+static uint8_t freedBlocks[BLOCK_SIZE];
+static int freedCount = 0;
+
+void fs_set_discard(int enabled) {
+    discardOnFree = enabled;
+}
+
 // Frees data blocks in the filesystem 
-void freeDataBlock(FILE *fp, int block_index) {
-    int rel_index = block_index - DATA_START_BLOCK;
+void freeDataBlock(BlockDevice *dev, int block_index) {
     uint8_t bitmap[BLOCK_SIZE];
-    fseek(fp, BITMAP_BLOCK * BLOCK_SIZE, SEEK_SET);
-    fread(bitmap, 1, BLOCK_SIZE, fp);
-    bitmap[rel_index / 8] &= ~(1 << (rel_index % 8));
-    fseek(fp, BITMAP_BLOCK * BLOCK_SIZE, SEEK_SET);
-    fwrite(bitmap, 1, BLOCK_SIZE, fp);
+    if (readBlock(dev, BITMAP_BLOCK, bitmap) != 0) return;
+    bitmapClear(bitmap, block_index);
+    if (writeBlock(dev, BITMAP_BLOCK, bitmap) != 0) return;
+    countFree(1, 0);
+
+    if (discardOnFree) {
+        bitmapSet(freedBlocks, block_index);
+        freedCount++;
+    }
+}
+
+// Accounts for the blocks set in freed, which an operation cleared in its own
+// copy of the bitmap and wrote back in one go, as freeDataBlock does for one
+void countFreedBlocks(const uint8_t *freed, int count) {
+    countFree(count, 0);
+    if (!discardOnFree) return;
+    for (int b = DATA_START_BLOCK; b < NUM_BLOCKS; b++) {
+        if (bitmapTest(freed, b)) bitmapSet(freedBlocks, b);
+    }
+    freedCount += count;
+}
+
+// Discards every run of data blocks that is free in the bitmap and, if only
+// is given, also marked in it. Returns the number of blocks discarded, or -1
+// if the device refused.
+static int discardFreeRuns(BlockDevice *dev, const uint8_t *bitmap, const uint8_t *only) {
+    int discarded = 0;
+    for (int b = DATA_START_BLOCK; b < NUM_BLOCKS;) {
+        int run = 0;
+        while (b + run < NUM_BLOCKS && !bitmapTest(bitmap, b + run) &&
+               (!only || bitmapTest(only, b + run))) run++;
+        if (run == 0) {
+            b++;
+            continue;
+        }
+        dropCached(dev, b, run);
+        // Not marked changed, free blocks hold nothing a backup has to carry
+        if (dev->discard(dev, b, run) != 0) return -1;
+        if (checksummed(b) && storeChecksums(dev, b, run, NULL) != 0) return -1;
+        discarded += run;
+        b += run;
+    }
+    return discarded;
+}
+
+// Blocks that were allocated again after being freed, as when write_fs
+// rewrites a file in place, are set in the bitmap by now and are kept
+static void discardFreedBlocks(BlockDevice *dev) {
+    if (freedCount == 0) return;
+
+    uint8_t bitmap[BLOCK_SIZE];
+    if (readBlock(dev, BITMAP_BLOCK, bitmap) == 0) discardFreeRuns(dev, bitmap, freedBlocks);
+    memset(freedBlocks, 0, sizeof(freedBlocks));
+    freedCount = 0;
+}
+
+int trim_fs(void) {
+    // Open the disk image file for reading and writing
+    BlockDevice *dev = openDisk(DISK_RDWR);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    uint8_t bitmap[BLOCK_SIZE];
+    if (readBlock(dev, BITMAP_BLOCK, bitmap) != 0) {
+        fprintf(stderr, "Error: Failed to read bitmap.\n");
+        closeDisk(dev);
+        return -1;
+    }
+
+    int trimmed = discardFreeRuns(dev, bitmap, NULL);
+    if (trimmed < 0) fprintf(stderr, "Error: Disk image does not support hole punching.\n");
+    closeDisk(dev);
+    return trimmed;
 }
 
 // Allocates an inode in the filesystem
-int allocInode(FILE *fp) {
+int allocInode(BlockDevice *dev) {
     Inode inode;
     for (int i = 0; i < NUM_INODES; ++i) {
-        fseek(fp, (INODE_START_BLOCK * BLOCK_SIZE) + i * sizeof(Inode), SEEK_SET);
-        fread(&inode, sizeof(Inode), 1, fp);
+        if (readInode(dev, i, &inode) != 0) return -1;
         if (!inode.is_valid) {
             inode.is_valid = 1;
-            fseek(fp, (INODE_START_BLOCK * BLOCK_SIZE) + i * sizeof(Inode), SEEK_SET);
-            fwrite(&inode, sizeof(Inode), 1, fp);
+            if (writeInode(dev, i, &inode) != 0) return -1;
+            countFree(0, -1);
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Allocates the first free inode at or after goal, wrapping around, so that
+// the inodes of one directory tend to share an inode table block
+int allocInodeNear(BlockDevice *dev, int goal) {
+    if (allocPolicy == ALLOC_FIRST_FIT || goal < 0 || goal >= NUM_INODES) return allocInode(dev);
+
+    Inode inode;
+    for (int k = 0; k < NUM_INODES; ++k) {
+        int i = (goal + k) % NUM_INODES;
+        if (readInode(dev, i, &inode) != 0) return -1;
+        if (!inode.is_valid) {
+            inode.is_valid = 1;
+            if (writeInode(dev, i, &inode) != 0) return -1;
+            countFree(0, -1);
             return i;
         }
     }
@@ -705,26 +2113,100 @@ int allocInode(FILE *fp) {
 }
 
 // Frees an inode in the filesystem
-void freeInode(FILE *fp, int inode_index) {
+void freeInode(BlockDevice *dev, int inode_index) {
     Inode inode = {0};
-    fseek(fp, (INODE_START_BLOCK * BLOCK_SIZE) + inode_index * sizeof(Inode), SEEK_SET);
-    fwrite(&inode, sizeof(Inode), 1, fp);
+    if (writeInode(dev, inode_index, &inode) == 0) countFree(0, 1);
 }
 
+// Changes to the free counters made by the operation in progress, closeDisk
+// adds them to the superblock with a single write
+static int freeBlocksDelta = 0;
+static int freeInodesDelta = 0;
+
+void countFree(int blocks, int inodes) {
+    freeBlocksDelta += blocks;
+    freeInodesDelta += inodes;
+}
+
+static void flushFreeCounts(BlockDevice *dev) {
+    if (freeBlocksDelta == 0 && freeInodesDelta == 0) return;
+
+    char block[BLOCK_SIZE];
+    if ((diskFeatures & FS_FEATURE_COUNTERS) && readBlock(dev, 0, block) == 0) {
+        SuperBlock sb;
+        memcpy(&sb, block, sizeof(SuperBlock));
+        sb.free_blocks += freeBlocksDelta;
+        sb.free_inodes += freeInodesDelta;
+        memcpy(block, &sb, sizeof(SuperBlock));
+        writeBlock(dev, 0, block);
+    }
+    freeBlocksDelta = freeInodesDelta = 0;
+}
+
+// Recursive usage is kept for every directory in one table block, indexed
+// by inode
+int readUsage(BlockDevice *dev, int dir_inode_index, DirUsage *out) {
+    DirUsage table[USAGE_PER_BLOCK];
+    if (dir_inode_index < 0 || dir_inode_index >= NUM_INODES) return -1;
+    if (readBlock(dev, USAGE_BLOCK, table) != 0) return -1;
+    *out = table[dir_inode_index];
+    return 0;
+}
+
+// Clears the usage of a directory inode that is about to be reused
+int resetUsage(BlockDevice *dev, int dir_inode_index) {
+    DirUsage table[USAGE_PER_BLOCK];
+    if (!(diskFeatures & FS_FEATURE_COUNTERS)) return 0;
+    if (readBlock(dev, USAGE_BLOCK, table) != 0) return -1;
+    table[dir_inode_index].bytes = 0;
+    table[dir_inode_index].inodes = 0;
+    return writeBlock(dev, USAGE_BLOCK, table);
+}
+
+// Adds to the usage of a directory and of every directory above it, found by
+// following ".." up to the root
+int chargeUsage(BlockDevice *dev, int dir_inode_index, int bytes, int inodes) {
+    DirUsage table[USAGE_PER_BLOCK];
+    if (!(diskFeatures & FS_FEATURE_COUNTERS) || (bytes == 0 && inodes == 0)) return 0;
+    if (readBlock(dev, USAGE_BLOCK, table) != 0) return -1;
+
+    int cur = dir_inode_index;
+    for (int depth = 0; cur >= 0 && cur < NUM_INODES && depth < NUM_INODES; depth++) {
+        table[cur].bytes += bytes;
+        table[cur].inodes += inodes;
+        if (cur == 0) break;
+        cur = findDirEntry(dev, cur, "..");
+    }
+    return writeBlock(dev, USAGE_BLOCK, table);
+}
+
+// Inodes are accessed through the block that holds them so that they share
+// the block cache with everything else
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(Inode))
+
 // Reads inodes in the filesystem
-int readInode(FILE *fp, int inode_index, Inode *out) {
-    fseek(fp, (INODE_START_BLOCK * BLOCK_SIZE) + inode_index * sizeof(Inode), SEEK_SET);
-    return fread(out, sizeof(Inode), 1, fp) == 1 ? 0 : -1;
+int readInode(BlockDevice *dev, int inode_index, Inode *out) {
+    if (inode_index < 0 || inode_index >= NUM_INODES) return -1;
+
+    Inode table[INODES_PER_BLOCK];
+    if (readBlock(dev, INODE_START_BLOCK + inode_index / INODES_PER_BLOCK, table) != 0) return -1;
+    *out = table[inode_index % INODES_PER_BLOCK];
+    return 0;
 }
 
 // Writes inodes in the filesystem
-int writeInode(FILE *fp, int inode_index, const Inode *in) {
-    fseek(fp, (INODE_START_BLOCK * BLOCK_SIZE) + inode_index * sizeof(Inode), SEEK_SET);
-    return fwrite(in, sizeof(Inode), 1, fp) == 1 ? 0 : -1;
+int writeInode(BlockDevice *dev, int inode_index, const Inode *in) {
+    if (inode_index < 0 || inode_index >= NUM_INODES) return -1;
+
+    Inode table[INODES_PER_BLOCK];
+    int block_index = INODE_START_BLOCK + inode_index / INODES_PER_BLOCK;
+    if (readBlock(dev, block_index, table) != 0) return -1;
+    table[inode_index % INODES_PER_BLOCK] = *in;
+    return writeBlock(dev, block_index, table);
 }
 
 // Helper function to resolve an absolute path to its inode index
-int resolvePath(FILE *fp, const char *path, int *parent_inode, char *name) {
+int resolvePath(BlockDevice *dev, const char *path, int *parent_inode, char *name) {
     if (strcmp(path, "/") == 0) return 0;
 
     char temp[256];
@@ -740,13 +2222,13 @@ int resolvePath(FILE *fp, const char *path, int *parent_inode, char *name) {
             if (name) strncpy(name, token, 28);
             if (!next) {
                 // If this is the last token, return the current inode index
-                int inodeIndex = findDirEntry(fp, current_inode, token);
+                int inodeIndex = findDirEntry(dev, current_inode, token);
                 return inodeIndex;
             }
         }
         prev_inode = current_inode;
         // Find the directory entry for the current token
-        current_inode = findDirEntry(fp, current_inode, token);
+        current_inode = findDirEntry(dev, current_inode, token);
         if (current_inode == -1) return -1;
         token = next;
     }
@@ -754,16 +2236,16 @@ int resolvePath(FILE *fp, const char *path, int *parent_inode, char *name) {
 }
 
 // Finds a directory entry by name in a directory's inode
-int findDirEntry(FILE *fp, int dir_inode_index, const char *name) {
+int findDirEntry(BlockDevice *dev, int dir_inode_index, const char *name) {
     Inode dir_inode;
-    if (readInode(fp, dir_inode_index, &dir_inode) != 0 || !dir_inode.is_directory) return -1;
+    if (readInode(dev, dir_inode_index, &dir_inode) != 0 || !dir_inode.is_directory) return -1;
 
     DirectoryEntry entries[MAX_DIR_ENTRIES];
     for (int i = 0; i < 4; i++) {
         // Skip unallocated blocks
         if (dir_inode.direct_blocks[i] == -1) continue;
         // Read the directory entries from this data block
-        readBlock(fp, dir_inode.direct_blocks[i], entries);
+        readBlock(dev, dir_inode.direct_blocks[i], entries);
         for (int j = 0; j < MAX_DIR_ENTRIES; j++) {
             // Check if the entry is valid and matches the name
             if (entries[j].inode_number != -1 && strcmp(entries[j].name, name) == 0) {
@@ -775,30 +2257,31 @@ int findDirEntry(FILE *fp, int dir_inode_index, const char *name) {
 }
 
 // Adds a directory entry to a directory's inode
-int addDirEntry(FILE *fp, int dir_inode_index, const char *name, int inode_index) {
+int addDirEntry(BlockDevice *dev, int dir_inode_index, const char *name, int inode_index) {
     Inode dir_inode;
     // Read the directory inode to ensure it exists and is a directory
-    if (readInode(fp, dir_inode_index, &dir_inode) != 0 || !dir_inode.is_directory) return -1;
+    if (readInode(dev, dir_inode_index, &dir_inode) != 0 || !dir_inode.is_directory) return -1;
 
     DirectoryEntry entries[MAX_DIR_ENTRIES];
     // Iterate through all data blocks allocated to this directory
     for (int i = 0; i < 4; i++) {
         if (dir_inode.direct_blocks[i] == -1) {
-            // Allocate a new data block if this one is empty
-            int blk = allocDataBlock(fp);
+            // Allocate a new data block if this one is empty, right after
+            // the directory's previous block where possible
+            int blk = allocDataBlockNear(dev, i > 0 ? dir_inode.direct_blocks[i - 1] + 1 : -1);
             if (blk == -1) return -1;
             dir_inode.direct_blocks[i] = blk;
             memset(entries, 0xFF, sizeof(entries));
             strncpy(entries[0].name, name, 27);
             entries[0].name[27] = '\0';
             entries[0].inode_number = inode_index;
-            writeBlock(fp, blk, entries);
+            writeBlock(dev, blk, entries);
             dir_inode.size++;
-            writeInode(fp, dir_inode_index, &dir_inode);
+            writeInode(dev, dir_inode_index, &dir_inode);
             return 0;
         }
         // Read existing entries from the data block
-        readBlock(fp, dir_inode.direct_blocks[i], entries);
+        readBlock(dev, dir_inode.direct_blocks[i], entries);
         for (int j = 0; j < MAX_DIR_ENTRIES; j++) {
             // Find an empty slot to add the new entry
             if (entries[j].inode_number == -1) {
@@ -807,9 +2290,9 @@ int addDirEntry(FILE *fp, int dir_inode_index, const char *name, int inode_index
                 entries[j].name[27] = '\0';
                 entries[j].inode_number = inode_index;
                 // Write the updated entries back to the block
-                writeBlock(fp, dir_inode.direct_blocks[i], entries);
+                writeBlock(dev, dir_inode.direct_blocks[i], entries);
                 dir_inode.size++;
-                writeInode(fp, dir_inode_index, &dir_inode);
+                writeInode(dev, dir_inode_index, &dir_inode);
                 return 0;
             }
         }
@@ -818,10 +2301,10 @@ int addDirEntry(FILE *fp, int dir_inode_index, const char *name, int inode_index
 }
 
 // Removes a directory entry from a directory's inode
-int removeDirEntry(FILE *fp, int dir_inode_index, const char *name) {
+int removeDirEntry(BlockDevice *dev, int dir_inode_index, const char *name) {
     Inode dir_inode;
     // Read the directory inode to ensure it exists and is a directory
-    if (readInode(fp, dir_inode_index, &dir_inode) != 0 || !dir_inode.is_directory) return -1;
+    if (readInode(dev, dir_inode_index, &dir_inode) != 0 || !dir_inode.is_directory) return -1;
 
     DirectoryEntry entries[MAX_DIR_ENTRIES];
     // Iterate through all data blocks allocated to this directory
@@ -829,19 +2312,42 @@ int removeDirEntry(FILE *fp, int dir_inode_index, const char *name) {
         // Skip unallocated blocks
         if (dir_inode.direct_blocks[i] == -1) continue;
         // Read existing entries from the data block
-        readBlock(fp, dir_inode.direct_blocks[i], entries);
+        readBlock(dev, dir_inode.direct_blocks[i], entries);
         for (int j = 0; j < MAX_DIR_ENTRIES; j++) {
             if (entries[j].inode_number != -1 && strcmp(entries[j].name, name) == 0) {
                 // Found the entry to remove, mark it as unused
                 entries[j].inode_number = -1;
                 entries[j].name[0] = '\0';
                 // Write the updated entries back to the block
-                writeBlock(fp, dir_inode.direct_blocks[i], entries);
+                writeBlock(dev, dir_inode.direct_blocks[i], entries);
                 dir_inode.size--;
-                writeInode(fp, dir_inode_index, &dir_inode);
+                writeInode(dev, dir_inode_index, &dir_inode);
                 return 0;
             }
         }
     }
     return -1; 
 }
+
+// Points an existing directory entry at a different inode, in place
+int replaceDirEntry(BlockDevice *dev, int dir_inode_index, const char *name, int inode_index) {
+    Inode dir_inode;
+    // Read the directory inode to ensure it exists and is a directory
+    if (readInode(dev, dir_inode_index, &dir_inode) != 0 || !dir_inode.is_directory) return -1;
+
+    DirectoryEntry entries[MAX_DIR_ENTRIES];
+    // Iterate through all data blocks allocated to this directory
+    for (int i = 0; i < 4; i++) {
+        // Skip unallocated blocks
+        if (dir_inode.direct_blocks[i] == -1) continue;
+        if (readBlock(dev, dir_inode.direct_blocks[i], entries) != 0) return -1;
+        for (int j = 0; j < MAX_DIR_ENTRIES; j++) {
+            if (entries[j].inode_number != -1 && strcmp(entries[j].name, name) == 0) {
+                // Found the entry, the size of the directory does not change
+                entries[j].inode_number = inode_index;
+                return writeBlock(dev, dir_inode.direct_blocks[i], entries);
+            }
+        }
+    }
+    return -1;
+}
@@ -1,14 +1,54 @@
 #ifndef FS_H
+#define FS_H
 
+#include <stdint.h>
 #include "disk.h"
+#include "blockdev.h"
 
-#define BLOCK_SIZE 1024
+// The inode table, usage table and checksum area are laid out for blocks of
+// at least 1 KiB, and direct I/O needs a power of two
+#if BLOCK_SIZE < 1024 || (BLOCK_SIZE & (BLOCK_SIZE - 1)) != 0
+#error "BLOCK_SIZE must be a power of two of at least 1024"
+#endif
 
 #define BITMAP_BLOCK 1
 #define INODE_START_BLOCK 2
 #define DATA_START_BLOCK 11
 #define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(DirectoryEntry))
 
+// CRC32C of every block, kept in the spare blocks at the end of the inode
+// area. A stored value of 0 means the block has no checksum.
+#define CSUM_START_BLOCK 7
+#define CSUM_BLOCKS ((NUM_BLOCKS * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define CSUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+// Recursive usage of every directory, a DirUsage per inode
+#define USAGE_BLOCK 6
+#define USAGE_PER_BLOCK (BLOCK_SIZE / sizeof(DirUsage))
+
+// Generation that last wrote each block. The metadata area has no room left,
+// so the table follows the last filesystem block and the image file is
+// GEN_BLOCKS longer than the filesystem. 0 means never written since mkfs.
+#define GEN_START_BLOCK NUM_BLOCKS
+#define GEN_BLOCKS ((NUM_BLOCKS * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define GENS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+// SuperBlock feature flags
+#define FS_FEATURE_CSUM 0x1 // Metadata blocks are checksummed
+#define FS_FEATURE_CSUM_DATA 0x2 // File data blocks are checksummed too
+#define FS_FEATURE_COUNTERS 0x4 // Free counters and directory usage are kept
+#define FS_FEATURE_CBT 0x8 // Written blocks are stamped with the generation
+
+// The data area is split into block groups, the locality allocator keeps a
+// directory and its files inside one group where it can
+#define BLOCK_GROUP_SIZE 128
+#define NUM_BLOCK_GROUPS ((NUM_BLOCKS - DATA_START_BLOCK + BLOCK_GROUP_SIZE - 1) / BLOCK_GROUP_SIZE)
+#define BLOCK_GROUP(block) (((block) - DATA_START_BLOCK) / BLOCK_GROUP_SIZE)
+
+// Block allocation policies, see fs_set_alloc_policy
+#define ALLOC_FIRST_FIT 0 // Lowest free block and inode
+#define ALLOC_LOCALITY 1 // Near the parent directory, the default
+
 // Superblock
 typedef struct { 
     int magic_number; // Filesystem identifier
@@ -17,6 +57,13 @@ typedef struct {
     int bitmap_start; // Block index of free-block bitmap
     int inode_start; // Block index of inode table
     int data_start; // Block index of first data block
+    int features; // FS_FEATURE_* flags, 0 on images made before they existed
+    int free_blocks; // Free data blocks, kept with FS_FEATURE_COUNTERS
+    int free_inodes; // Free inodes, kept with FS_FEATURE_COUNTERS
+    int generation; // Stamped on blocks written now, kept with FS_FEATURE_CBT
+    int stripe_count; // Files a striped volume spans, 0 for a single image file
+    int stripe_unit; // Blocks per file before a striped volume moves to the next
+    int block_size; // BLOCK_SIZE the image was made with, 0 on older 1 KiB images
 } SuperBlock;
 
 // Inode
@@ -33,28 +80,229 @@ typedef struct {
     char name[28]; // File or directory name (27 chars + null terminator)
 } DirectoryEntry;
 
+// Directory entry with the attributes of the inode it names, see readdirplus_fs
+typedef struct {
+    int inode_number;
+    int is_directory; // 0=file, 1=directory
+    int size; // bytes (file) or entry count (directory)
+    char name[28];
+} DirEntryPlus;
+
+// Everything below a directory: bytes in files and number of files and
+// directories, not counting the directory itself
+typedef struct {
+    int bytes;
+    int inodes;
+} DirUsage;
+
+// Capacity figures returned by statfs_fs
+typedef struct {
+    int block_size;
+    int total_blocks; // Data blocks
+    int free_blocks;
+    int total_inodes;
+    int free_inodes;
+} StatFs;
+
+// Writeback of a mounted image's block cache. The flusher wakes every
+// interval_ms and writes back blocks dirty for expire_ms, or every dirty
+// block once background_ratio percent of the cache is dirty. A write taking
+// the cache to dirty_ratio percent writes all dirty blocks back itself.
+typedef struct {
+    int enabled; // 0 keeps the cache write-through
+    int interval_ms;
+    int expire_ms;
+    int background_ratio;
+    int dirty_ratio;
+} WritebackTunables;
+
+typedef struct {
+    unsigned long dirty_blocks; // Dirty right now
+    unsigned long flushed_blocks; // Written back so far
+    unsigned long flush_writes; // Device writes doing so, adjacent blocks share one
+    unsigned long flusher_passes; // Times the flusher found dirty blocks
+    unsigned long throttled; // Writes that had to write back themselves
+} WritebackStats;
+
+#define READDIR_END -1 // Cookie value once a directory has been fully listed
+
+// Fragmentation report produced by fragreport_fs and defrag_fs
+typedef struct {
+    int files; // Valid inodes (files and directories)
+    int fragmented_files; // Inodes whose blocks are not contiguous
+    int extents; // Runs of contiguous blocks over all inodes
+    int used_blocks; // Allocated data blocks
+    int free_blocks; // Free data blocks
+    int free_extents; // Runs of free data blocks
+    int largest_free_extent; // Longest run of free data blocks
+    int last_used_block; // Highest allocated block index
+} FragReport;
+
+// Block placement report produced by layoutreport_fs. Distances are in
+// blocks and averaged over regular files that have data.
+typedef struct {
+    int files; // Regular files with at least one data block
+    int groups; // Block groups in the data area
+    int cross_group_files; // Files starting in another group than their directory
+    double avg_parent_distance; // From a file's first block to its directory's first block
+    double avg_gap; // Blocks skipped between consecutive blocks of a file
+} LayoutReport;
+
+// Totals produced by du_fs for a file or directory tree
+typedef struct {
+    int files; // Regular files in the tree
+    int directories; // Directories in the tree, including its top
+    int blocks; // Data blocks used by files and directories
+    long bytes; // Sum of file sizes
+} DuReport;
+
+#define TREE_PATH_MAX 256 // Longest path find_fs reports
+
+// Problems found by fsck_fs
+typedef struct {
+    int bad_pointers; // Block pointers outside the data area
+    int duplicate_blocks; // Blocks claimed by more than one inode
+    int dangling_entries; // Directory entries naming a free inode
+    int orphan_inodes; // Valid inodes not reachable from the root
+    int bad_parent_links; // Directories whose ".." names the wrong parent
+    int bad_dir_sizes; // Directories whose entry count is wrong
+    int leaked_blocks; // Marked in the bitmap but not used by a reachable inode
+    int missing_blocks; // Used by a reachable inode but free in the bitmap
+    int bad_checksums; // Blocks whose contents do not match their checksum
+    int bad_counters; // Free counters or directory usage that are off
+    int repaired; // 1 if the problems were fixed
+} FsckReport;
+
 // Filesystem operations
 void mkfs(const char *diskfile);
+int mkfs_dev(BlockDevice *dev);
 int mkdir_fs(const char *path);
 int create_fs(const char *path);
 int write_fs(const char *path, const char *data);
 int read_fs(const char *path, char *buf, int bufsize); 
+// Vectored variants of read_fs and write_fs, taking fewer than BDEV_IOV_MAX buffers
+int readv_fs(const char *path, const struct iovec *iov, int iovcnt);
+int writev_fs(const char *path, const struct iovec *iov, int iovcnt);
 int delete_fs(const char *path);
 int rmdir_fs(const char *path); 
+int rename_fs(const char *oldpath, const char *newpath);
 int ls_fs(const char *path, DirectoryEntry *entries , int max_entries);
+int readdirplus_fs(const char *path, DirEntryPlus *entries, int max_entries, int *cookie);
+
+// Free space and inodes from the superblock counters, and the recursive
+// usage of a directory, both without scanning anything
+int statfs_fs(StatFs *out);
+int dirusage_fs(const char *path, DirUsage *out);
+
+// Recursive operations walking a tree with num_threads threads (0 picks one
+// per CPU). rmtree_fs returns the number of files and directories removed,
+// find_fs the number of names matching a shell pattern, of which up to
+// max_matches paths are stored sorted in matches.
+int rmtree_fs(const char *path, int num_threads);
+int du_fs(const char *path, int num_threads, DuReport *report);
+int find_fs(const char *path, const char *pattern, char (*matches)[TREE_PATH_MAX], int max_matches, int num_threads);
+
+// Bulk copy between a host directory tree and a directory in the image,
+// both return the number of files and directories copied
+int import_fs(const char *hostdir, const char *path);
+int export_fs(const char *path, const char *hostdir);
+
+// Defragmentation, max_moves <= 0 means no limit
+int defrag_fs(int max_moves, FragReport *report);
+int fragreport_fs(FragReport *report);
+int layoutreport_fs(LayoutReport *report);
+
+// Punches holes over all free data blocks, returns the number of blocks
+int trim_fs(void);
+
+// Copies the image to dst, writing only metadata and blocks in use so the
+// copy is a sparse file. Returns the number of blocks written.
+int copyimage_fs(const char *dst);
+
+// Changed-block tracking. changedblocks_fs stores up to max_blocks indexes of
+// blocks written after generation since and returns how many there are.
+// exportincremental_fs saves those blocks to a patch file and starts a new
+// generation, the one to pass as since next time is stored in *generation.
+// applyincremental_fs patches a replica image, creating it for a patch made
+// since generation 0. Both return the number of blocks in the patch.
+int changedblocks_fs(int since, int *blocks, int max_blocks, int *generation);
+int exportincremental_fs(int since, const char *patchfile, int *generation);
+int applyincremental_fs(const char *patchfile, const char *replica);
+
+// Consistency check, returns the number of problems found or -1 on error
+int fsck_fs(const char *diskfile, int repair, int num_threads, FsckReport *report);
+
+// Image the operations use while nothing is mounted, "disk.img" by default
+void fs_set_image(const char *diskfile);
+const char *fs_image(void);
+
+// Mounting keeps a device open with a warm block cache for the whole
+// process, every operation above then works on the mounted device.
+// mount_dev leaves closing the device to the caller, e.g. to save a RAM disk.
+int mount_fs(const char *diskfile);
+int mount_dev(BlockDevice *dev);
+void unmount_fs(void);
+void fs_cache_stats(unsigned long *hits, unsigned long *misses);
+
+// Tunables take effect at the next mount
+int fs_set_writeback(const WritebackTunables *tunables);
+void fs_writeback_stats(WritebackStats *stats);
+
+// Chooses where new blocks and inodes go, ALLOC_LOCALITY unless changed
+void fs_set_alloc_policy(int policy);
+
+// Makes mkfs checksum file data blocks as well as metadata
+void fs_set_data_checksums(int enabled);
+
+// Makes mkfs create a volume striped over files image.0 ... image.N-1 with
+// unit blocks per stripe unit, instead of a single image file. Operations
+// find the volume when no single image file of that name exists.
+int fs_set_stripes(int files, int unit);
+
+// Makes operations open a single image file with O_DIRECT, so its blocks are
+// not cached by the kernel as well as by the mounted block cache. Striped
+// volumes keep using buffered I/O.
+void fs_set_direct_io(int enabled);
+
+// With discard on, blocks freed by an operation are punched out of the image
+// when the operation finishes instead of keeping their stale data
+void fs_set_discard(int enabled);
 
 // Helper functions for filesystem operations
-int readBlock(FILE *fp, int block_index, void *buf);
-int writeBlock(FILE *fp, int block_index, const void *buf);
-int allocDataBlock(FILE *fp);
-void freeDataBlock(FILE *fp, int block_index);
-int allocInode(FILE *fp);
-void freeInode(FILE *fp, int inode_index);
-int readInode(FILE *fp, int inode_index, Inode *out);
-int writeInode(FILE *fp, int inode_index, const Inode *in);
-int resolvePath(FILE *fp, const char *path, int *parent_inode, char *name);
-int findDirEntry(FILE *fp, int dir_inode_index, const char *name);
-int addDirEntry(FILE *fp, int dir_inode_index, const char *name, int inode_index);
-int removeDirEntry(FILE *fp, int dir_inode_index, const char *name);
+#define DISK_RDONLY 0
+#define DISK_RDWR 1
+BlockDevice *openImage(const char *diskfile, int writable);
+BlockDevice *openDisk(int writable);
+void closeDisk(BlockDevice *dev);
+int readBlock(BlockDevice *dev, int block_index, void *buf);
+int writeBlock(BlockDevice *dev, int block_index, const void *buf);
+int flushCache(BlockDevice *dev); // Before reading the device directly
+int readBlocks(BlockDevice *dev, int first_block, void *buf, int count);
+int writeBlocks(BlockDevice *dev, int first_block, const void *buf, int count);
+int readBlocksv(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt);
+int writeBlocksv(BlockDevice *dev, int first_block, const struct iovec *iov, int iovcnt);
+uint32_t blockChecksum(const void *buf);
+int bitmapTest(const uint8_t *bitmap, int block_index);
+void bitmapSet(uint8_t *bitmap, int block_index);
+void bitmapClear(uint8_t *bitmap, int block_index);
+int allocDataBlock(BlockDevice *dev);
+int allocDataBlockNear(BlockDevice *dev, int goal);
+int allocDirBlock(BlockDevice *dev, int parent_inode);
+void freeDataBlock(BlockDevice *dev, int block_index);
+void countFreedBlocks(const uint8_t *freed, int count);
+int allocInode(BlockDevice *dev);
+int allocInodeNear(BlockDevice *dev, int goal);
+void freeInode(BlockDevice *dev, int inode_index);
+void countFree(int blocks, int inodes);
+int readUsage(BlockDevice *dev, int dir_inode_index, DirUsage *out);
+int resetUsage(BlockDevice *dev, int dir_inode_index);
+int chargeUsage(BlockDevice *dev, int dir_inode_index, int bytes, int inodes);
+int readInode(BlockDevice *dev, int inode_index, Inode *out);
+int writeInode(BlockDevice *dev, int inode_index, const Inode *in);
+int resolvePath(BlockDevice *dev, const char *path, int *parent_inode, char *name);
+int findDirEntry(BlockDevice *dev, int dir_inode_index, const char *name);
+int addDirEntry(BlockDevice *dev, int dir_inode_index, const char *name, int inode_index);
+int removeDirEntry(BlockDevice *dev, int dir_inode_index, const char *name);
+int replaceDirEntry(BlockDevice *dev, int dir_inode_index, const char *name, int inode_index);
 
 #endif // !FS_H
\ No newline at end of file
@@ -0,0 +1,529 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fs.h"
+#include "disk.h"
+
+#define FSCK_MAX_THREADS 16
+
+// State shared by the checker threads. Everything a thread learns is
+// recorded with atomics or in the slots of its own inodes. Reachability is
+// worked out after the scan, and the image itself is only modified by the
+// single-threaded repair pass.
+typedef struct {
+    uint8_t *image;             // mmapped disk image
+    Inode *inodes;              // inode table inside the mapping
+    const uint8_t *bitmap;      // block bitmap inside the mapping
+    atomic_int refs[NUM_BLOCKS];        // number of inodes claiming each block
+    int parent[NUM_INODES];             // directory the root's tree reaches each inode through, -1 if none
+    int dotdot[NUM_INODES];             // ".." target of each directory, -1 if none
+    int entryCount[NUM_INODES];         // named entries found in each directory
+    atomic_int badPointers;
+    atomic_int duplicateBlocks;
+    atomic_int danglingEntries;
+} FsckState;
+
+typedef struct {
+    FsckState *st;
+    int first;
+    int last;
+} FsckTask;
+
+static int validBlock(int blk) {
+    return blk >= DATA_START_BLOCK && blk < NUM_BLOCKS;
+}
+
+static int validInodeRef(const FsckState *st, int ino) {
+    return ino >= 0 && ino < NUM_INODES && st->inodes[ino].is_valid;
+}
+
+// Scans one stripe of the inode table: claims the blocks of every valid inode
+// and, for directories, walks their entries. Only metadata is touched, data
+// blocks of regular files are never read.
+static void *scanInodes(void *arg) {
+    FsckTask *task = arg;
+    FsckState *st = task->st;
+
+    for (int i = task->first; i < task->last; i++) {
+        const Inode *inode = &st->inodes[i];
+        if (!inode->is_valid) continue;
+
+        for (int s = 0; s < 4; s++) {
+            int blk = inode->direct_blocks[s];
+            if (blk == -1) continue;
+            if (!validBlock(blk)) {
+                atomic_fetch_add(&st->badPointers, 1);
+                continue;
+            }
+            if (atomic_fetch_add(&st->refs[blk], 1) > 0) {
+                atomic_fetch_add(&st->duplicateBlocks, 1);
+            }
+        }
+
+        if (!inode->is_directory) continue;
+
+        for (int s = 0; s < 4; s++) {
+            int blk = inode->direct_blocks[s];
+            if (!validBlock(blk)) continue;
+
+            const DirectoryEntry *entries = (const DirectoryEntry *)(st->image + (size_t)blk * BLOCK_SIZE);
+            for (int j = 0; j < (int)MAX_DIR_ENTRIES; j++) {
+                int target = entries[j].inode_number;
+                if (target == -1) continue;
+
+                if (!validInodeRef(st, target)) {
+                    atomic_fetch_add(&st->danglingEntries, 1);
+                    continue;
+                }
+                if (strcmp(entries[j].name, ".") == 0) continue;
+                if (strcmp(entries[j].name, "..") == 0) {
+                    st->dotdot[i] = target;
+                    continue;
+                }
+
+                st->entryCount[i]++;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Marks every inode reachable from the root with a breadth-first walk over
+// the entries of reachable directories, so a detached directory naming a live
+// inode cannot claim it. The first directory to reach an inode becomes its
+// parent. Each directory block is read once.
+static void computeReachable(FsckState *st, int *reachable) {
+    int queue[NUM_INODES];
+    int head = 0;
+    int tail = 0;
+    for (int i = 0; i < NUM_INODES; i++) {
+        reachable[i] = 0;
+        st->parent[i] = -1;
+    }
+    reachable[0] = 1;
+    st->parent[0] = 0;
+    queue[tail++] = 0;
+
+    while (head < tail) {
+        int dir = queue[head++];
+        for (int s = 0; s < 4; s++) {
+            int blk = st->inodes[dir].direct_blocks[s];
+            if (!validBlock(blk)) continue;
+
+            const DirectoryEntry *entries = (const DirectoryEntry *)(st->image + (size_t)blk * BLOCK_SIZE);
+            for (int j = 0; j < (int)MAX_DIR_ENTRIES; j++) {
+                int target = entries[j].inode_number;
+                if (!validInodeRef(st, target) || reachable[target]) continue;
+                if (strcmp(entries[j].name, ".") == 0 || strcmp(entries[j].name, "..") == 0) continue;
+
+                reachable[target] = 1;
+                st->parent[target] = dir;
+                if (st->inodes[target].is_directory) queue[tail++] = target;
+            }
+        }
+    }
+}
+
+// Rewrites a directory's entries so that none point at freed inodes and ".."
+// points at the directory that actually names it
+static void repairDirectory(FsckState *st, int dir, const int *reachable) {
+    Inode *inode = &st->inodes[dir];
+    int named = 0;
+
+    for (int s = 0; s < 4; s++) {
+        int blk = inode->direct_blocks[s];
+        if (!validBlock(blk)) continue;
+
+        DirectoryEntry *entries = (DirectoryEntry *)(st->image + (size_t)blk * BLOCK_SIZE);
+        for (int j = 0; j < (int)MAX_DIR_ENTRIES; j++) {
+            int target = entries[j].inode_number;
+            if (target == -1) continue;
+
+            // "." and ".." are rewritten rather than dropped, whatever they
+            // pointed at before
+            if (strcmp(entries[j].name, ".") == 0) {
+                entries[j].inode_number = dir;
+                continue;
+            }
+            if (strcmp(entries[j].name, "..") == 0) {
+                entries[j].inode_number = st->parent[dir];
+                continue;
+            }
+            if (!validInodeRef(st, target) || reachable[target] != 1) {
+                entries[j].inode_number = -1;
+                entries[j].name[0] = '\0';
+                continue;
+            }
+            named++;
+        }
+    }
+    inode->size = named;
+}
+
+static int isChecksumBlock(int blk) {
+    return blk >= CSUM_START_BLOCK && blk < CSUM_START_BLOCK + (int)CSUM_BLOCKS;
+}
+
+enum { BLOCK_UNUSED, BLOCK_DATA, BLOCK_METADATA };
+
+// Classifies the blocks fsck checksums: the metadata area, the blocks of
+// directories, and the data blocks of valid files. Free blocks are never
+// read, so checking stays proportional to what is in use.
+static void classifyBlocks(const FsckState *st, uint8_t *kind) {
+    memset(kind, BLOCK_UNUSED, NUM_BLOCKS);
+    for (int b = 0; b < DATA_START_BLOCK; b++) {
+        if (!isChecksumBlock(b)) kind[b] = BLOCK_METADATA;
+    }
+    for (int i = 0; i < NUM_INODES; i++) {
+        if (!st->inodes[i].is_valid) continue;
+        for (int s = 0; s < 4; s++) {
+            int blk = st->inodes[i].direct_blocks[s];
+            if (!validBlock(blk)) continue;
+            if (st->inodes[i].is_directory) kind[blk] = BLOCK_METADATA;
+            else if (kind[blk] == BLOCK_UNUSED) kind[blk] = BLOCK_DATA;
+        }
+    }
+}
+
+// Counts the blocks in use whose stored checksum does not match their contents
+static int checkChecksums(const FsckState *st) {
+    const uint32_t *sums = (const uint32_t *)(st->image + (size_t)CSUM_START_BLOCK * BLOCK_SIZE);
+    uint8_t kind[NUM_BLOCKS];
+    classifyBlocks(st, kind);
+
+    int bad = 0;
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+        if (kind[b] == BLOCK_UNUSED || sums[b] == 0) continue;
+        if (sums[b] != blockChecksum(st->image + (size_t)b * BLOCK_SIZE)) bad++;
+    }
+    return bad;
+}
+
+// Records fresh checksums for the metadata the repair pass may have
+// rewritten, and for data blocks that no longer match since their current
+// contents are all that is left of them. Free blocks lose their checksum.
+static void restampChecksums(FsckState *st) {
+    uint32_t *sums = (uint32_t *)(st->image + (size_t)CSUM_START_BLOCK * BLOCK_SIZE);
+    uint8_t kind[NUM_BLOCKS];
+    classifyBlocks(st, kind);
+
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+        if (isChecksumBlock(b)) continue;
+        if (kind[b] == BLOCK_UNUSED) {
+            sums[b] = 0;
+            continue;
+        }
+        if (kind[b] == BLOCK_DATA && sums[b] == 0) continue;
+        uint32_t actual = blockChecksum(st->image + (size_t)b * BLOCK_SIZE);
+        if (kind[b] == BLOCK_METADATA || sums[b] != actual) sums[b] = actual;
+    }
+}
+
+// Recomputes the free counters and the usage of every reachable directory
+// and counts how many of the stored values are off. With fix set the stored
+// values are replaced.
+static int checkCounters(FsckState *st, const int *reachable, int fix) {
+    SuperBlock *sb = (SuperBlock *)st->image;
+    DirUsage *usage = (DirUsage *)(st->image + (size_t)USAGE_BLOCK * BLOCK_SIZE);
+    DirUsage expect[NUM_INODES];
+    memset(expect, 0, sizeof(expect));
+
+    int freeBlocks = 0;
+    int freeInodes = 0;
+    for (int b = DATA_START_BLOCK; b < NUM_BLOCKS; b++) {
+        if (!bitmapTest(st->bitmap, b)) freeBlocks++;
+    }
+    for (int i = 0; i < NUM_INODES; i++) {
+        if (!st->inodes[i].is_valid) freeInodes++;
+    }
+
+    // Charge every reachable inode to each directory above it
+    for (int i = 1; i < NUM_INODES; i++) {
+        if (!st->inodes[i].is_valid || reachable[i] != 1) continue;
+        int bytes = st->inodes[i].is_directory ? 0 : st->inodes[i].size;
+        int p = st->parent[i];
+        for (int depth = 0; p != -1 && depth < NUM_INODES; depth++) {
+            expect[p].bytes += bytes;
+            expect[p].inodes++;
+            if (p == 0) break;
+            p = st->parent[p];
+        }
+    }
+
+    int bad = (sb->free_blocks != freeBlocks) + (sb->free_inodes != freeInodes);
+    for (int i = 0; i < NUM_INODES; i++) {
+        if (!st->inodes[i].is_valid || !st->inodes[i].is_directory || reachable[i] != 1) continue;
+        if (usage[i].bytes != expect[i].bytes || usage[i].inodes != expect[i].inodes) {
+            bad++;
+            if (fix) usage[i] = expect[i];
+        }
+    }
+    if (fix) {
+        sb->free_blocks = freeBlocks;
+        sb->free_inodes = freeInodes;
+    }
+    return bad;
+}
+
+// The image being checked. A single image file is mapped so the checker
+// threads can read metadata without any copying. A striped volume has no one
+// file to map, so it is read into memory and written back after repairs.
+typedef struct {
+    uint8_t *data;
+    size_t size; // The filesystem, plus the generation table when present
+    int fd;
+    BlockDevice *volume;
+} FsckImage;
+
+static int openFsckImage(const char *diskfile, int repair, FsckImage *img) {
+    memset(img, 0, sizeof(*img));
+    img->fd = open(diskfile, repair ? O_RDWR : O_RDONLY);
+    if (img->fd < 0 && errno == ENOENT) img->volume = openImage(diskfile, repair);
+    if (img->fd < 0 && !img->volume) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    struct stat stbuf;
+    off_t size = img->volume ? (off_t)img->volume->num_blocks * BLOCK_SIZE : 0;
+    if (!img->volume && fstat(img->fd, &stbuf) == 0) size = stbuf.st_size;
+    if (size < DISK_SIZE) {
+        fprintf(stderr, "Error: Disk image is truncated.\n");
+        if (img->fd >= 0) close(img->fd);
+        bdev_close(img->volume);
+        return -1;
+    }
+    img->size = DISK_SIZE;
+    if (size >= (off_t)(NUM_BLOCKS + GEN_BLOCKS) * BLOCK_SIZE) img->size += GEN_BLOCKS * BLOCK_SIZE;
+
+    if (img->volume) {
+        img->data = malloc(img->size);
+        if (img->data && img->volume->read(img->volume, 0, img->size / BLOCK_SIZE, img->data) == 0) return 0;
+        fprintf(stderr, "Error: Could not read disk image.\n");
+        free(img->data);
+        bdev_close(img->volume);
+        return -1;
+    }
+
+    int prot = PROT_READ | (repair ? PROT_WRITE : 0);
+    img->data = mmap(NULL, img->size, prot, MAP_SHARED, img->fd, 0);
+    if (img->data == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map disk image.\n");
+        close(img->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static int syncFsckImage(FsckImage *img) {
+    if (!img->volume) return msync(img->data, img->size, MS_SYNC);
+    if (img->volume->write(img->volume, 0, img->size / BLOCK_SIZE, img->data) != 0) return -1;
+    return img->volume->sync(img->volume);
+}
+
+static void closeFsckImage(FsckImage *img) {
+    if (img->volume) {
+        free(img->data);
+        bdev_close(img->volume);
+        return;
+    }
+    munmap(img->data, img->size);
+    close(img->fd);
+}
+
+// Repairs bypass the block layer, so the metadata and directory blocks they
+// may have rewritten are stamped for the next incremental backup here
+static void stampRepairs(FsckState *st) {
+    const SuperBlock *sb = (const SuperBlock *)st->image;
+    uint32_t *gens = (uint32_t *)(st->image + (size_t)GEN_START_BLOCK * BLOCK_SIZE);
+    for (int b = 0; b < DATA_START_BLOCK; b++) gens[b] = sb->generation;
+    for (int i = 0; i < NUM_INODES; i++) {
+        if (!st->inodes[i].is_valid || !st->inodes[i].is_directory) continue;
+        for (int s = 0; s < 4; s++) {
+            int blk = st->inodes[i].direct_blocks[s];
+            if (validBlock(blk)) gens[blk] = sb->generation;
+        }
+    }
+}
+
+int fsck_fs(const char *diskfile, int repair, int num_threads, FsckReport *report) {
+    if (!diskfile || !report) {
+        fprintf(stderr, "Error: Invalid arguments to fsck_fs.\n");
+        return -1;
+    }
+    memset(report, 0, sizeof(*report));
+
+    FsckImage img;
+    if (openFsckImage(diskfile, repair, &img) != 0) return -1;
+    uint8_t *image = img.data;
+    size_t mapSize = img.size;
+
+    const SuperBlock *sb = (const SuperBlock *)image;
+    if (sb->magic_number == MAGIC_NUMBER && sb->block_size != 0 && sb->block_size != BLOCK_SIZE) {
+        fprintf(stderr, "Error: Image has %d byte blocks, this build uses %d.\n", sb->block_size, BLOCK_SIZE);
+        closeFsckImage(&img);
+        return -1;
+    }
+    Inode *inodes = (Inode *)(image + (size_t)INODE_START_BLOCK * BLOCK_SIZE);
+    if (sb->magic_number != MAGIC_NUMBER || !inodes[0].is_valid || !inodes[0].is_directory) {
+        fprintf(stderr, "Error: Superblock or root directory is corrupt.\n");
+        closeFsckImage(&img);
+        return -1;
+    }
+
+    FsckState *st = calloc(1, sizeof(FsckState));
+    int *reachable = malloc(NUM_INODES * sizeof(int));
+    if (!st || !reachable) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        free(st);
+        free(reachable);
+        closeFsckImage(&img);
+        return -1;
+    }
+
+    st->image = image;
+    st->inodes = inodes;
+    st->bitmap = image + (size_t)BITMAP_BLOCK * BLOCK_SIZE;
+    for (int i = 0; i < NUM_INODES; i++) st->dotdot[i] = -1;
+
+    // Split the inode table across the worker threads
+    if (num_threads <= 0) num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > FSCK_MAX_THREADS) num_threads = FSCK_MAX_THREADS;
+
+    pthread_t threads[FSCK_MAX_THREADS];
+    FsckTask tasks[FSCK_MAX_THREADS];
+    int started = 0;
+    for (int t = 0; t < num_threads; t++) {
+        tasks[t].st = st;
+        tasks[t].first = NUM_INODES * t / num_threads;
+        tasks[t].last = NUM_INODES * (t + 1) / num_threads;
+        if (t > 0 && pthread_create(&threads[t], NULL, scanInodes, &tasks[t]) == 0) {
+            started |= 1 << t;
+        } else {
+            scanInodes(&tasks[t]);
+        }
+    }
+    for (int t = 1; t < num_threads; t++) {
+        if (started & (1 << t)) pthread_join(threads[t], NULL);
+    }
+
+    computeReachable(st, reachable);
+
+    report->bad_pointers = atomic_load(&st->badPointers);
+    report->duplicate_blocks = atomic_load(&st->duplicateBlocks);
+    report->dangling_entries = atomic_load(&st->danglingEntries);
+
+    for (int i = 1; i < NUM_INODES; i++) {
+        if (!inodes[i].is_valid) continue;
+        if (reachable[i] != 1) {
+            report->orphan_inodes++;
+            continue;
+        }
+        if (inodes[i].is_directory && st->dotdot[i] != st->parent[i]) {
+            report->bad_parent_links++;
+        }
+    }
+    for (int i = 0; i < NUM_INODES; i++) {
+        if (inodes[i].is_valid && reachable[i] == 1 && inodes[i].is_directory &&
+            inodes[i].size != st->entryCount[i]) {
+            report->bad_dir_sizes++;
+        }
+    }
+
+    // Compare the blocks of reachable inodes against the bitmap
+    int *inUse = calloc(NUM_BLOCKS, sizeof(int));
+    if (!inUse) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        free(st);
+        free(reachable);
+        closeFsckImage(&img);
+        return -1;
+    }
+    for (int i = 0; i < NUM_INODES; i++) {
+        if (!inodes[i].is_valid || reachable[i] != 1) continue;
+        for (int s = 0; s < 4; s++) {
+            if (validBlock(inodes[i].direct_blocks[s])) inUse[inodes[i].direct_blocks[s]] = 1;
+        }
+    }
+    for (int b = DATA_START_BLOCK; b < NUM_BLOCKS; b++) {
+        int marked = bitmapTest(st->bitmap, b);
+        if (marked && !inUse[b]) report->leaked_blocks++;
+        if (!marked && inUse[b]) report->missing_blocks++;
+    }
+
+    int checksums = sb->features & FS_FEATURE_CSUM;
+    if (checksums) report->bad_checksums = checkChecksums(st);
+    int counters = sb->features & FS_FEATURE_COUNTERS;
+    if (counters) report->bad_counters = checkCounters(st, reachable, 0);
+
+    int problems = report->bad_pointers + report->duplicate_blocks + report->dangling_entries +
+                   report->orphan_inodes + report->bad_parent_links + report->bad_dir_sizes +
+                   report->leaked_blocks + report->missing_blocks + report->bad_checksums +
+                   report->bad_counters;
+
+    if (repair && problems > 0) {
+        // Drop out-of-range pointers and give every shared block to the
+        // lowest numbered inode claiming it
+        int *owner = inUse;
+        for (int b = 0; b < NUM_BLOCKS; b++) owner[b] = -1;
+        for (int i = 0; i < NUM_INODES; i++) {
+            if (!inodes[i].is_valid) continue;
+            for (int s = 0; s < 4; s++) {
+                int blk = inodes[i].direct_blocks[s];
+                if (blk == -1) continue;
+                if (!validBlock(blk) || (reachable[i] == 1 && owner[blk] != -1)) {
+                    inodes[i].direct_blocks[s] = -1;
+                    continue;
+                }
+                if (reachable[i] == 1) owner[blk] = i;
+            }
+        }
+
+        // Release unreachable inodes, their blocks are reclaimed below
+        for (int i = 1; i < NUM_INODES; i++) {
+            if (inodes[i].is_valid && reachable[i] != 1) {
+                memset(&inodes[i], 0, sizeof(Inode));
+                reachable[i] = 0;
+            }
+        }
+
+        for (int i = 0; i < NUM_INODES; i++) {
+            if (inodes[i].is_valid && inodes[i].is_directory) repairDirectory(st, i, reachable);
+        }
+
+        // Rebuild the bitmap from the blocks that are still referenced
+        uint8_t *bitmap = image + (size_t)BITMAP_BLOCK * BLOCK_SIZE;
+        for (int b = DATA_START_BLOCK; b < NUM_BLOCKS; b++) {
+            if (owner[b] != -1) bitmapSet(bitmap, b);
+            else bitmapClear(bitmap, b);
+        }
+
+        // Counters last, they depend on the repaired bitmap and tree, then the
+        // checksums of everything rewritten
+        if (counters) checkCounters(st, reachable, 1);
+        if (checksums) restampChecksums(st);
+        if ((sb->features & FS_FEATURE_CBT) && mapSize > DISK_SIZE) stampRepairs(st);
+
+        if (syncFsckImage(&img) != 0) {
+            fprintf(stderr, "Error: Failed to write repairs to disk image.\n");
+            problems = -1;
+        } else {
+            report->repaired = 1;
+        }
+    }
+
+    free(inUse);
+    free(st);
+    free(reachable);
+    closeFsckImage(&img);
+    return problems;
+}
@@ -0,0 +1,81 @@
+#ifndef FSNET_H
+#define FSNET_H
+
+#include <stdint.h>
+#include "fs.h"
+
+#define FSNET_DEFAULT_SOCKET "mini_fs.sock"
+#define FSNET_MAX_PAYLOAD (BLOCK_SIZE * 8) // Largest request or response body
+
+// Operation codes, one per fs.h operation plus a few for the daemon itself
+enum {
+    FSNET_PING = 0,
+    FSNET_MKDIR = 1,   // path
+    FSNET_CREATE = 2,  // path
+    FSNET_WRITE = 3,   // path, data
+    FSNET_READ = 4,    // path -> data
+    FSNET_DELETE = 5,  // path
+    FSNET_RMDIR = 6,   // path
+    FSNET_LS = 7,      // int32 cookie, path -> int32 next cookie, DirEntryPlus[]
+    FSNET_STATS = 8    // -> FsNetStats
+};
+
+// Every request is a header followed by len bytes of payload. Paths in a
+// payload are NUL terminated, write data follows the path's terminator and
+// runs to the end of the payload.
+typedef struct {
+    uint32_t id;  // Chosen by the client, echoed in the response
+    uint32_t op;
+    uint32_t len;
+} FsNetRequest;
+
+// Responses carry the id of their request. Requests on one connection may be
+// answered out of order, so clients that pipeline must match on id.
+typedef struct {
+    uint32_t id;
+    int32_t status; // Return value of the operation, negative on failure
+    uint32_t len;
+} FsNetResponse;
+
+typedef struct {
+    uint64_t requests;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t dirty_blocks;
+    uint64_t flushed_blocks;
+    uint64_t flush_writes;
+    uint64_t throttled;
+} FsNetStats;
+
+// Daemon, serves the mounted image until SIGINT or SIGTERM
+int serve_fs(const char *diskfile, const char *socket_path, int num_workers);
+
+// Client library
+typedef struct {
+    int fd;
+    uint32_t next_id;
+} FsClient;
+
+FsClient *fsclient_connect(const char *socket_path);
+void fsclient_close(FsClient *client);
+
+// Pipelining interface: send any number of requests, then collect the
+// responses. fsclient_send returns the request id, fsclient_recv the status.
+int fsclient_send(FsClient *client, uint32_t op, const void *payload, uint32_t len);
+int fsclient_recv(FsClient *client, uint32_t *id, void *buf, uint32_t bufsize, uint32_t *len);
+
+// Synchronous calls mirroring fs.h
+int fsclient_mkdir(FsClient *client, const char *path);
+int fsclient_create(FsClient *client, const char *path);
+int fsclient_write(FsClient *client, const char *path, const char *data);
+int fsclient_read(FsClient *client, const char *path, char *buf, int bufsize);
+int fsclient_delete(FsClient *client, const char *path);
+int fsclient_rmdir(FsClient *client, const char *path);
+int fsclient_ls(FsClient *client, const char *path, DirEntryPlus *entries, int max_entries, int *cookie);
+int fsclient_stats(FsClient *client, FsNetStats *stats);
+
+// Load generator, runs num_clients connections each issuing ops_per_client
+// requests with up to depth of them in flight
+int loadgen_fs(const char *socket_path, int num_clients, int ops_per_client, int depth);
+
+#endif // !FSNET_H
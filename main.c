@@ -2,9 +2,64 @@
 #include <string.h>
 #include <stdlib.h>
 #include "fs.h"
+#include "fsnet.h"
 #include "disk.h"
 
+static void printFragReport(const FragReport *report) {
+    printf("Inodes in use: %d\n", report->files);
+    printf("Fragmented inodes: %d\n", report->fragmented_files);
+    printf("Extents: %d\n", report->extents);
+    printf("Used blocks: %d, free blocks: %d\n", report->used_blocks, report->free_blocks);
+    printf("Free extents: %d, largest free extent: %d blocks\n",
+           report->free_extents, report->largest_free_extent);
+    printf("Last used block: %d\n", report->last_used_block);
+}
+
 int main(int argc, char *argv[]) {
+    // Optional "-i <image>" selects the disk image, disk.img by default,
+    // "-a firstfit" turns off locality-aware allocation, "-d" punches holes
+    // over the blocks each command frees, "-w" sets the writeback of a
+    // served image and "-o direct" opens the image with O_DIRECT
+    while (argc >= 2 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-d") == 0) {
+            fs_set_discard(1);
+            argv++;
+            argc--;
+            continue;
+        }
+        if (argc < 3) break;
+        if (strcmp(argv[1], "-i") == 0) {
+            fs_set_image(argv[2]);
+        } else if (strcmp(argv[1], "-w") == 0) {
+            // "off", "on" with the default tunables, or
+            // interval_ms,expire_ms,background_ratio,dirty_ratio
+            WritebackTunables wb = { .enabled = 0, .interval_ms = 100, .dirty_ratio = 100 };
+            if (strcmp(argv[2], "on") == 0) {
+                wb = (WritebackTunables){ .enabled = 1, .interval_ms = 100, .expire_ms = 500,
+                                          .background_ratio = 10, .dirty_ratio = 20 };
+            } else if (strcmp(argv[2], "off") != 0) {
+                wb.enabled = 1;
+                if (sscanf(argv[2], "%d,%d,%d,%d", &wb.interval_ms, &wb.expire_ms,
+                           &wb.background_ratio, &wb.dirty_ratio) != 4) {
+                    fprintf(stderr, "Error: Bad writeback tunables %s.\n", argv[2]);
+                    return 1;
+                }
+            }
+            if (fs_set_writeback(&wb) != 0) return 1;
+        } else if (strcmp(argv[1], "-o") == 0 && strcmp(argv[2], "direct") == 0) {
+            fs_set_direct_io(1);
+        } else if (strcmp(argv[1], "-a") == 0 && strcmp(argv[2], "firstfit") == 0) {
+            fs_set_alloc_policy(ALLOC_FIRST_FIT);
+        } else if (strcmp(argv[1], "-a") == 0 && strcmp(argv[2], "locality") == 0) {
+            fs_set_alloc_policy(ALLOC_LOCALITY);
+        } else {
+            fprintf(stderr, "Error: Unknown option %s.\n", argv[1]);
+            return 1;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+
     if (argc == 1) {
         /* Example sequence:
         • Create a directory.
@@ -15,7 +70,7 @@ int main(int argc, char *argv[]) {
         • Demonstrate bitmap/inode reuse.
         */
 
-        mkfs("disk.img");
+        mkfs(fs_image());
         printf("Disk formatted successfully.\n");
 
         // Create a directory /kovan
@@ -78,8 +133,21 @@ int main(int argc, char *argv[]) {
         // Command Line Interface for MiniFS that handles from terminal directly
         const char *cmd = argv[1];
 
-        if (strcmp(cmd, "mkfs") == 0 && argc == 2) {
-            mkfs("disk.img");
+        if (strcmp(cmd, "mkfs") == 0) {
+            // "-c" checksums file data as well as metadata, "-s <files> <unit>"
+            // stripes the volume over several files
+            for (int i = 2; i < argc; i++) {
+                if (strcmp(argv[i], "-c") == 0) {
+                    fs_set_data_checksums(1);
+                } else if (strcmp(argv[i], "-s") == 0 && i + 2 < argc) {
+                    if (fs_set_stripes(atoi(argv[i + 1]), atoi(argv[i + 2])) != 0) return 1;
+                    i += 2;
+                } else {
+                    fprintf(stderr, "Error: Unknown mkfs option %s.\n", argv[i]);
+                    return 1;
+                }
+            }
+            mkfs(fs_image());
             printf("Disk formatted successfully.\n");
             return 0;
         } else if (strcmp(cmd, "mkdir_fs") == 0 && argc == 3) {
@@ -115,6 +183,11 @@ int main(int argc, char *argv[]) {
                 printf("Directory %s removed successfully.\n", argv[2]);
                 return 0;
             } else return 1;
+        } else if (strcmp(cmd, "rename_fs") == 0 && argc == 4) {
+            if (rename_fs(argv[2], argv[3]) == 0) {
+                printf("Renamed %s to %s successfully.\n", argv[2], argv[3]);
+                return 0;
+            } else return 1;
         } else if (strcmp(cmd, "ls_fs") == 0 && argc == 3) {
             DirectoryEntry entries[BLOCK_SIZE / sizeof(DirectoryEntry)] = {0};
             int max_entries = sizeof(entries) / sizeof(entries[0]);
@@ -126,6 +199,163 @@ int main(int argc, char *argv[]) {
                 }
                 return 0;
             } else return 1;
+        } else if (strcmp(cmd, "ls_fs") == 0 && argc == 4 && strcmp(argv[2], "-l") == 0) {
+            // Long listing, pages through the directory a batch at a time
+            DirEntryPlus entries[16];
+            int cookie = 0;
+            while (cookie != READDIR_END) {
+                int count = readdirplus_fs(argv[3], entries, 16, &cookie);
+                if (count < 0) return 1;
+                for (int i = 0; i < count; ++i) {
+                    printf("%c %6d %4d %s\n", entries[i].is_directory ? 'd' : '-',
+                           entries[i].size, entries[i].inode_number, entries[i].name);
+                }
+            }
+            return 0;
+        } else if (strcmp(cmd, "import") == 0 && (argc == 3 || argc == 4)) {
+            // Optional second argument is the destination directory in the image
+            int count = import_fs(argv[2], argc == 4 ? argv[3] : "/");
+            if (count >= 0) {
+                printf("Imported %d files and directories from %s.\n", count, argv[2]);
+                return 0;
+            } else return 1;
+        } else if (strcmp(cmd, "export") == 0 && (argc == 3 || argc == 4)) {
+            // Optional second argument is the source directory in the image
+            int count = export_fs(argc == 4 ? argv[3] : "/", argv[2]);
+            if (count >= 0) {
+                printf("Exported %d files and directories to %s.\n", count, argv[2]);
+                return 0;
+            } else return 1;
+        } else if (strcmp(cmd, "serve") == 0 && argc <= 4) {
+            // Optional socket path and worker count
+            const char *sock = argc >= 3 ? argv[2] : FSNET_DEFAULT_SOCKET;
+            int workers = argc == 4 ? atoi(argv[3]) : 0;
+            return serve_fs(fs_image(), sock, workers) == 0 ? 0 : 1;
+        } else if (strcmp(cmd, "loadgen") == 0 && argc <= 6) {
+            // Optional socket path, clients, requests per client and pipeline depth
+            const char *sock = argc >= 3 ? argv[2] : FSNET_DEFAULT_SOCKET;
+            int clients = argc >= 4 ? atoi(argv[3]) : 8;
+            int ops = argc >= 5 ? atoi(argv[4]) : 10000;
+            int depth = argc >= 6 ? atoi(argv[5]) : 16;
+            return loadgen_fs(sock, clients, ops, depth) == 0 ? 0 : 1;
+        } else if (strcmp(cmd, "fragreport") == 0 && argc == 2) {
+            FragReport report;
+            if (fragreport_fs(&report) == 0) {
+                printFragReport(&report);
+                return 0;
+            } else return 1;
+        } else if (strcmp(cmd, "df") == 0 && argc == 2) {
+            StatFs st;
+            if (statfs_fs(&st) != 0) return 1;
+            int used = st.total_blocks - st.free_blocks;
+            printf("Blocks: %d total, %d used, %d free (%d bytes each)\n",
+                   st.total_blocks, used, st.free_blocks, st.block_size);
+            printf("Inodes: %d total, %d used, %d free\n",
+                   st.total_inodes, st.total_inodes - st.free_inodes, st.free_inodes);
+            return 0;
+        } else if (strcmp(cmd, "usage") == 0 && (argc == 2 || argc == 3)) {
+            DirUsage usage;
+            const char *path = argc == 3 ? argv[2] : "/";
+            if (dirusage_fs(path, &usage) != 0) return 1;
+            printf("%s: %d bytes in %d entries\n", path, usage.bytes, usage.inodes);
+            return 0;
+        } else if (strcmp(cmd, "rmtree") == 0 && argc == 3) {
+            int removed = rmtree_fs(argv[2], 0);
+            if (removed < 0) return 1;
+            printf("Removed %d files and directories.\n", removed);
+            return 0;
+        } else if (strcmp(cmd, "du") == 0 && (argc == 2 || argc == 3)) {
+            DuReport report;
+            const char *path = argc == 3 ? argv[2] : "/";
+            if (du_fs(path, 0, &report) != 0) return 1;
+            printf("%s: %d files, %d directories, %ld bytes in %d blocks\n",
+                   path, report.files, report.directories, report.bytes, report.blocks);
+            return 0;
+        } else if (strcmp(cmd, "find") == 0 && (argc == 3 || argc == 4)) {
+            // Optional start path, then a shell pattern for the names
+            const char *path = argc == 4 ? argv[2] : "/";
+            static char matches[NUM_INODES][TREE_PATH_MAX];
+            int found = find_fs(path, argv[argc - 1], matches, NUM_INODES, 0);
+            if (found < 0) return 1;
+            for (int i = 0; i < found && i < NUM_INODES; i++) printf("%s\n", matches[i]);
+            return 0;
+        } else if (strcmp(cmd, "trim") == 0 && argc == 2) {
+            int trimmed = trim_fs();
+            if (trimmed < 0) return 1;
+            printf("Trimmed %d free blocks.\n", trimmed);
+            return 0;
+        } else if (strcmp(cmd, "copyimg") == 0 && argc == 3) {
+            int copied = copyimage_fs(argv[2]);
+            if (copied < 0) return 1;
+            printf("Copied %d blocks to %s.\n", copied, argv[2]);
+            return 0;
+        } else if (strcmp(cmd, "diff") == 0 && argc == 4 && strcmp(argv[2], "--since") == 0) {
+            // Changed blocks are listed as runs of consecutive indexes
+            static int blocks[NUM_BLOCKS];
+            int generation;
+            int changed = changedblocks_fs(atoi(argv[3]), blocks, NUM_BLOCKS, &generation);
+            if (changed < 0) return 1;
+            printf("Current generation: %d\n", generation);
+            printf("Blocks changed since generation %d: %d\n", atoi(argv[3]), changed);
+            for (int i = 0; i < changed;) {
+                int j = i;
+                while (j + 1 < changed && blocks[j + 1] == blocks[j] + 1) j++;
+                if (j == i) printf("%d\n", blocks[i]);
+                else printf("%d-%d\n", blocks[i], blocks[j]);
+                i = j + 1;
+            }
+            return 0;
+        } else if (strcmp(cmd, "export-incremental") == 0 && argc == 5 && strcmp(argv[2], "--since") == 0) {
+            int generation;
+            int exported = exportincremental_fs(atoi(argv[3]), argv[4], &generation);
+            if (exported < 0) return 1;
+            printf("Exported %d blocks to %s, next backup: --since %d\n", exported, argv[4], generation);
+            return 0;
+        } else if (strcmp(cmd, "apply") == 0 && argc == 4) {
+            int applied = applyincremental_fs(argv[2], argv[3]);
+            if (applied < 0) return 1;
+            printf("Applied %d blocks to %s.\n", applied, argv[3]);
+            return 0;
+        } else if (strcmp(cmd, "layout") == 0 && argc == 2) {
+            LayoutReport report;
+            if (layoutreport_fs(&report) != 0) return 1;
+            printf("Files with data: %d\n", report.files);
+            printf("Block groups: %d, files outside their directory's group: %d\n",
+                   report.groups, report.cross_group_files);
+            printf("Average distance to directory block: %.1f blocks\n", report.avg_parent_distance);
+            printf("Average gap between file blocks: %.1f blocks\n", report.avg_gap);
+            return 0;
+        } else if (strcmp(cmd, "defrag") == 0 && (argc == 2 || argc == 3)) {
+            // Optional argument limits the number of block moves for this run
+            int maxMoves = (argc == 3) ? atoi(argv[2]) : 0;
+            FragReport report;
+            int moves = defrag_fs(maxMoves, &report);
+            if (moves >= 0) {
+                printf("Defragmentation moved %d blocks.\n", moves);
+                printFragReport(&report);
+                return 0;
+            } else return 1;
+        } else if (strcmp(cmd, "fsck") == 0 && (argc == 2 || (argc == 3 && strcmp(argv[2], "-r") == 0))) {
+            // "-r" repairs the problems that were found
+            FsckReport report;
+            int problems = fsck_fs(fs_image(), argc == 3, 0, &report);
+            if (problems < 0) return 1;
+            printf("Bad block pointers: %d\n", report.bad_pointers);
+            printf("Duplicate blocks: %d\n", report.duplicate_blocks);
+            printf("Dangling directory entries: %d\n", report.dangling_entries);
+            printf("Orphan inodes: %d\n", report.orphan_inodes);
+            printf("Bad parent links: %d\n", report.bad_parent_links);
+            printf("Bad directory sizes: %d\n", report.bad_dir_sizes);
+            printf("Leaked blocks: %d\n", report.leaked_blocks);
+            printf("Missing blocks: %d\n", report.missing_blocks);
+            printf("Bad checksums: %d\n", report.bad_checksums);
+            printf("Bad counters: %d\n", report.bad_counters);
+            if (problems == 0) {
+                printf("Filesystem is clean.\n");
+                return 0;
+            }
+            printf(report.repaired ? "Filesystem repaired.\n" : "Filesystem has errors.\n");
+            return report.repaired ? 0 : 1;
         } else {
             fprintf(stderr, "Error: Unknown command or syntax usage.\n");
             return 1;
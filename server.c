@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fs.h"
+#include "fsnet.h"
+
+#define SERVE_MAX_WORKERS 64
+#define SERVE_MAX_JOBS 1024 // Requests queued or running before readers wait
+
+// One client connection. Readers and workers share it, the last one to drop
+// its reference closes the socket.
+typedef struct Conn {
+    int fd;
+    int refs;
+    pthread_mutex_t lock; // Serializes responses and guards refs
+    struct Conn *next; // In the list of connections with a live reader
+} Conn;
+
+// A decoded request waiting for a worker
+typedef struct Job {
+    Conn *conn;
+    FsNetRequest req;
+    char *payload;
+    struct Job *next;
+} Job;
+
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER; // A job was queued
+static pthread_cond_t queueSpace = PTHREAD_COND_INITIALIZER; // A job finished
+static Job *queueHead = NULL;
+static Job *queueTail = NULL;
+static int pendingJobs = 0; // Queued or running
+static int workersStop = 0;
+static volatile sig_atomic_t stopping = 0;
+static uint64_t requestCount = 0;
+
+// Connections whose reader is still running, so shutdown can stop them
+static pthread_mutex_t connsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readersDone = PTHREAD_COND_INITIALIZER;
+static Conn *conns = NULL;
+static int activeReaders = 0;
+
+static void onSignal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static int readFull(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int writeFull(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void connRelease(Conn *conn) {
+    pthread_mutex_lock(&conn->lock);
+    int last = --conn->refs == 0;
+    pthread_mutex_unlock(&conn->lock);
+    if (last) {
+        close(conn->fd);
+        pthread_mutex_destroy(&conn->lock);
+        free(conn);
+    }
+}
+
+static void sendResponse(Conn *conn, uint32_t id, int32_t status, const void *body, uint32_t len) {
+    FsNetResponse resp = { .id = id, .status = status, .len = len };
+
+    // Header and body go out back to back so pipelined responses never interleave
+    pthread_mutex_lock(&conn->lock);
+    if (writeFull(conn->fd, &resp, sizeof(resp)) == 0 && len > 0) {
+        writeFull(conn->fd, body, len);
+    }
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Returns the path at the start of a payload, or NULL if it is not terminated
+static const char *payloadPath(const char *payload, uint32_t len, uint32_t offset) {
+    if (offset >= len || !memchr(payload + offset, '\0', len - offset)) return NULL;
+    return payload + offset;
+}
+
+// Runs one request against the mounted image and answers it
+static void execute(Job *job) {
+    static __thread char out[FSNET_MAX_PAYLOAD];
+    const char *payload = job->payload;
+    uint32_t len = job->req.len;
+    uint32_t outLen = 0;
+    int status = -1;
+
+    const char *path = payloadPath(payload, len, job->req.op == FSNET_LS ? sizeof(int32_t) : 0);
+
+    switch (job->req.op) {
+    case FSNET_PING:
+        status = 0;
+        break;
+    case FSNET_MKDIR:
+        if (path) status = mkdir_fs(path);
+        break;
+    case FSNET_CREATE:
+        if (path) status = create_fs(path);
+        break;
+    case FSNET_WRITE:
+        if (path) {
+            // write_fs takes a string, so copy the data out and terminate it
+            size_t pathLen = strlen(path) + 1;
+            size_t dataLen = len - pathLen;
+            char *data = malloc(dataLen + 1);
+            if (data) {
+                memcpy(data, payload + pathLen, dataLen);
+                data[dataLen] = '\0';
+                status = write_fs(path, data);
+                free(data);
+            }
+        }
+        break;
+    case FSNET_READ:
+        if (path) {
+            status = read_fs(path, out, sizeof(out));
+            if (status > 0) outLen = status;
+        }
+        break;
+    case FSNET_DELETE:
+        if (path) status = delete_fs(path);
+        break;
+    case FSNET_RMDIR:
+        if (path) status = rmdir_fs(path);
+        break;
+    case FSNET_LS:
+        if (path) {
+            int32_t cookie;
+            memcpy(&cookie, payload, sizeof(cookie));
+            int cookieIn = cookie;
+            int maxEntries = (sizeof(out) - sizeof(int32_t)) / sizeof(DirEntryPlus);
+            status = readdirplus_fs(path, (DirEntryPlus *)(out + sizeof(int32_t)), maxEntries, &cookieIn);
+            if (status >= 0) {
+                cookie = cookieIn;
+                memcpy(out, &cookie, sizeof(cookie));
+                outLen = sizeof(int32_t) + status * sizeof(DirEntryPlus);
+            }
+        }
+        break;
+    case FSNET_STATS: {
+        FsNetStats stats = {0};
+        unsigned long hits, misses;
+        WritebackStats wb;
+        fs_cache_stats(&hits, &misses);
+        fs_writeback_stats(&wb);
+        pthread_mutex_lock(&queueLock);
+        stats.requests = requestCount;
+        pthread_mutex_unlock(&queueLock);
+        stats.cache_hits = hits;
+        stats.cache_misses = misses;
+        stats.dirty_blocks = wb.dirty_blocks;
+        stats.flushed_blocks = wb.flushed_blocks;
+        stats.flush_writes = wb.flush_writes;
+        stats.throttled = wb.throttled;
+        memcpy(out, &stats, sizeof(stats));
+        outLen = sizeof(stats);
+        status = 0;
+        break;
+    }
+    default:
+        fprintf(stderr, "Error: Unknown request %u.\n", job->req.op);
+        break;
+    }
+
+    sendResponse(job->conn, job->req.id, status, out, outLen);
+}
+
+// Workers run until told to stop and the queue is empty
+static void *workerMain(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&queueLock);
+        while (!queueHead && !workersStop) pthread_cond_wait(&queueCond, &queueLock);
+        if (!queueHead) {
+            pthread_mutex_unlock(&queueLock);
+            break;
+        }
+        Job *job = queueHead;
+        queueHead = job->next;
+        if (!queueHead) queueTail = NULL;
+        pthread_mutex_unlock(&queueLock);
+
+        execute(job);
+
+        pthread_mutex_lock(&queueLock);
+        pendingJobs--;
+        pthread_cond_broadcast(&queueSpace);
+        pthread_mutex_unlock(&queueLock);
+
+        connRelease(job->conn);
+        free(job->payload);
+        free(job);
+    }
+    return NULL;
+}
+
+static void connUnlist(Conn *conn) {
+    pthread_mutex_lock(&connsLock);
+    for (Conn **p = &conns; *p; p = &(*p)->next) {
+        if (*p == conn) {
+            *p = conn->next;
+            break;
+        }
+    }
+    activeReaders--;
+    pthread_cond_broadcast(&readersDone);
+    pthread_mutex_unlock(&connsLock);
+}
+
+// Reads requests off one connection and queues them for the workers. The
+// reader never waits for a response, which is what lets clients pipeline,
+// but it does wait while the queue is full, which pushes back on a client
+// sending faster than the workers keep up.
+static void *readerMain(void *arg) {
+    Conn *conn = arg;
+
+    while (1) {
+        FsNetRequest req;
+        if (readFull(conn->fd, &req, sizeof(req)) != 0) break;
+        if (req.len > FSNET_MAX_PAYLOAD) {
+            fprintf(stderr, "Error: Request too large, dropping client.\n");
+            break;
+        }
+
+        Job *job = malloc(sizeof(Job));
+        char *payload = malloc(req.len + 1);
+        if (!job || !payload || readFull(conn->fd, payload, req.len) != 0) {
+            free(job);
+            free(payload);
+            break;
+        }
+        payload[req.len] = '\0';
+
+        pthread_mutex_lock(&conn->lock);
+        conn->refs++;
+        pthread_mutex_unlock(&conn->lock);
+
+        job->conn = conn;
+        job->req = req;
+        job->payload = payload;
+        job->next = NULL;
+
+        pthread_mutex_lock(&queueLock);
+        while (pendingJobs >= SERVE_MAX_JOBS) pthread_cond_wait(&queueSpace, &queueLock);
+        if (queueTail) queueTail->next = job;
+        else queueHead = job;
+        queueTail = job;
+        pendingJobs++;
+        requestCount++;
+        pthread_cond_signal(&queueCond);
+        pthread_mutex_unlock(&queueLock);
+    }
+
+    connUnlist(conn);
+    connRelease(conn);
+    return NULL;
+}
+
+// Waits for every queued request to finish, then for the workers to exit
+static void stopWorkers(pthread_t *workers, int count) {
+    pthread_mutex_lock(&queueLock);
+    while (pendingJobs > 0) pthread_cond_wait(&queueSpace, &queueLock);
+    workersStop = 1;
+    pthread_cond_broadcast(&queueCond);
+    pthread_mutex_unlock(&queueLock);
+    for (int i = 0; i < count; i++) pthread_join(workers[i], NULL);
+}
+
+int serve_fs(const char *diskfile, const char *socket_path, int num_workers) {
+    if (num_workers <= 0) num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers < 1) num_workers = 1;
+    if (num_workers > SERVE_MAX_WORKERS) num_workers = SERVE_MAX_WORKERS;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path too long.\n");
+        return -1;
+    }
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    // Keep the image open with a warm cache for as long as we serve it
+    if (mount_fs(diskfile) != 0) return -1;
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 64) != 0) {
+        fprintf(stderr, "Error: Could not listen on %s.\n", socket_path);
+        if (listenFd >= 0) close(listenFd);
+        unmount_fs();
+        return -1;
+    }
+
+    // accept must return on a signal so the daemon can shut down
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t workers[SERVE_MAX_WORKERS];
+    workersStop = 0;
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i], NULL, workerMain, NULL) != 0) {
+            fprintf(stderr, "Error: Could not start worker threads.\n");
+            num_workers = i;
+            stopping = 1;
+            break;
+        }
+    }
+    if (stopping) {
+        stopWorkers(workers, num_workers);
+        close(listenFd);
+        unlink(socket_path);
+        unmount_fs();
+        return -1;
+    }
+
+    printf("Serving disk image on %s with %d workers.\n", socket_path, num_workers);
+    fflush(stdout);
+
+    while (!stopping) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) continue;
+
+        Conn *conn = malloc(sizeof(Conn));
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->refs = 1; // Held by the reader
+        pthread_mutex_init(&conn->lock, NULL);
+
+        pthread_mutex_lock(&connsLock);
+        conn->next = conns;
+        conns = conn;
+        activeReaders++;
+        pthread_mutex_unlock(&connsLock);
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, readerMain, conn) != 0) {
+            connUnlist(conn);
+            connRelease(conn);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    close(listenFd);
+    unlink(socket_path);
+
+    // Stop taking requests: end every reader by shutting down the reading
+    // side of its connection, responses can still be sent
+    pthread_mutex_lock(&connsLock);
+    for (Conn *c = conns; c; c = c->next) shutdown(c->fd, SHUT_RD);
+    while (activeReaders > 0) pthread_cond_wait(&readersDone, &connsLock);
+    pthread_mutex_unlock(&connsLock);
+
+    // Then let the queued requests finish before the image goes away
+    stopWorkers(workers, num_workers);
+    unmount_fs();
+    printf("Server stopped.\n");
+    return 0;
+}
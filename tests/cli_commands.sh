@@ -0,0 +1,308 @@
+#!/bin/sh
+# Command line checks run by make check: sh tests/cli_commands.sh ./mini_fs
+# Each section formats a scratch image in tests/scratch and prints every
+# command with its output, which make check compares to
+# tests/cli_expected_output.txt. Offsets assume the default 1 KiB blocks.
+
+FS=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+cd "$(dirname "$0")" || exit 1
+rm -rf scratch
+mkdir scratch && cd scratch || exit 1
+
+# run <command> ... runs mini_fs on $IMG, errors included
+IMG=check.img
+run() {
+    echo "\$ $*"
+    "$FS" -i $IMG "$@" 2>&1
+}
+
+# Reads and writes a little-endian int32 at a byte offset of check.img
+BS=1024
+peek() { od -An -t d4 -j "$1" -N4 check.img | tr -d ' '; }
+poke() {
+    printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $(( $2 & 255 )) $(( ($2 >> 8) & 255 )) \
+        $(( ($2 >> 16) & 255 )) $(( ($2 >> 24) & 255 )))" |
+        dd of=check.img bs=1 seek="$1" conv=notrunc 2>/dev/null
+}
+# entry <dir block> <slot> and block <inode> give the offset of a directory
+# entry's inode number and of an inode's first block pointer
+entry() { echo $(( $1 * BS + $2 * 32 )); }
+block() { peek $(( 2 * BS + $1 * 32 + 8 )); }
+ROOT_BLOCK=11
+
+echo "== fsck repair"
+run mkfs
+run mkdir_fs /d
+run create_fs /d/f
+run write_fs /d/f kept
+run mkdir_fs /o
+run create_fs /o/g
+D=$(peek $(entry $ROOT_BLOCK 0))
+O=$(peek $(entry $ROOT_BLOCK 1))
+F=$(peek $(entry $(block $D) 2))
+# Unlink /o from the root, point its entry for g at /d/f instead and break
+# the ".." of /d
+poke $(entry $ROOT_BLOCK 1) -1
+poke $(entry $(block $O) 2) $F
+poke $(entry $(block $D) 1) 99
+run fsck
+run fsck -r
+run read_fs /d/f
+run ls_fs -l /
+run df
+run fsck
+
+echo "== defragmentation"
+run mkfs
+# Files of two to four blocks, rewritten and deleted with first fit
+# allocation so their blocks end up scattered over the holes left behind
+make_file() { yes "$1" | head -c $(( $2 * BS - 100 )) > $1.txt; }
+for f in a b c d e; do
+    make_file $f 2
+    "$FS" -i check.img create_fs /$f >/dev/null
+    "$FS" -i check.img -a firstfit write_fs /$f "$(cat $f.txt)" >/dev/null
+done
+"$FS" -i check.img delete_fs /b >/dev/null
+"$FS" -i check.img delete_fs /d >/dev/null
+for f in f a; do
+    make_file $f 4
+    [ $f = f ] && "$FS" -i check.img create_fs /f >/dev/null
+    "$FS" -i check.img -a firstfit write_fs /$f "$(cat $f.txt)" >/dev/null
+done
+run fragreport
+run defrag 3
+run defrag 3
+run fsck
+run defrag
+run defrag
+run fsck
+for f in a c e f; do
+    echo "\$ read_fs /$f"
+    "$FS" -i check.img read_fs /$f > $f.out 2>&1
+    printf '%s\n' "$(cat $f.txt)" | cmp -s - $f.out && echo "matches $f.txt" || echo "differs from $f.txt"
+done
+
+echo "== import and export"
+mkdir -p src/sub
+echo first > src/one.txt
+echo second > src/sub/two.txt
+: > src/sub/empty
+echo long > src/a_name_longer_than_twenty_seven
+dd if=/dev/zero of=src/big bs=$BS count=5 2>/dev/null
+run mkfs
+run mkdir_fs /imp
+echo "\$ import src /imp"
+"$FS" -i check.img import src /imp 2>&1 | sort
+run read_fs /imp/sub/two.txt
+run usage /imp
+run export dst /imp
+echo "\$ diff -r src dst"
+diff -r src dst
+run fsck
+
+echo "== daemon"
+run mkfs
+echo "\$ serve check.sock 2"
+"$FS" -i check.img serve check.sock 2 >/dev/null 2>&1 &
+SERVER=$!
+i=0
+while [ ! -S check.sock ] && [ $i -lt 50 ]; do sleep 0.1; i=$(( i + 1 )); done
+echo "\$ loadgen check.sock 4 200 8"
+"$FS" loadgen check.sock 4 200 8 2>&1 | grep '^Requests'
+kill -TERM $SERVER
+wait $SERVER
+echo "server exited with $?"
+run df
+run fsck
+
+echo "== rename"
+run mkfs
+run mkdir_fs /a
+run mkdir_fs /b
+run create_fs /a/x
+run write_fs /a/x one
+run create_fs /b/y
+run write_fs /b/y two
+run rename_fs /a/x /b/y
+run read_fs /b/y
+run ls_fs /a
+run rename_fs /a /b
+run rename_fs /b /a
+run ls_fs -l /a
+run mkdir_fs /c
+run rename_fs /a /c/a
+run rename_fs /c /c/a/c
+run rename_fs /c/a/y /c
+run rename_fs /c/a/y /c/a/y
+run ls_fs -l /c/a
+run usage /c
+run df
+run fsck
+
+echo "== block allocation"
+# The same directories and files with each allocator, files written in
+# turns so first fit interleaves their blocks
+for policy in firstfit locality; do
+    run mkfs
+    for d in x y z; do "$FS" -i check.img -a $policy mkdir_fs /$d >/dev/null; done
+    "$FS" -i check.img -a $policy mkdir_fs /x/sub >/dev/null
+    for f in a b c; do
+        for d in x y z x/sub; do
+            "$FS" -i check.img -a $policy create_fs /$d/$f >/dev/null
+            "$FS" -i check.img -a $policy write_fs /$d/$f "$d/$f" >/dev/null
+        done
+    done
+    echo "\$ -a $policy: mkdir_fs /x /y /z /x/sub, create_fs and write_fs a b c in each"
+    run layout
+    run fsck
+done
+
+echo "== hole punching"
+run mkfs -c
+run create_fs /a
+echo "\$ write_fs /a <2000 bytes of q>"
+"$FS" -i check.img write_fs /a "$(yes q | head -c 2000 | tr -d '\n')" 2>&1
+run create_fs /b
+run write_fs /b small
+run copyimg copy.img
+# mkfs writes every block of the image, copyimg only those in use
+[ $(du -k copy.img | cut -f1) -lt $(du -k check.img | cut -f1) ] &&
+    echo "copy.img takes less space than check.img" || echo "copy.img is not sparse"
+echo "\$ -i copy.img read_fs /b"
+"$FS" -i copy.img read_fs /b 2>&1
+echo "runs of q in the image: $(grep -ac qqqqqqqq check.img)"
+echo "\$ -d delete_fs /a"
+"$FS" -i check.img -d delete_fs /a 2>&1
+echo "runs of q in the image: $(grep -ac qqqqqqqq check.img)"
+run fsck
+run trim
+run diff --since 0
+run read_fs /b
+run fsck
+
+echo "== rmtree, du and find"
+run mkfs
+run mkdir_fs /t
+run mkdir_fs /t/s
+run create_fs /t/a.txt
+run write_fs /t/a.txt alpha
+run create_fs /t/s/b.txt
+run write_fs /t/s/b.txt beta
+run create_fs /t/s/c.log
+run du /t
+echo "\$ find /t '*.txt'"
+"$FS" -i check.img find /t '*.txt' 2>&1 | sort
+run usage /t
+run rmtree /t/s
+run du /
+run rmtree /t
+run rmtree /t
+run df
+run usage
+run fsck
+
+echo "== find past the longest path"
+run mkfs
+# Ten levels of 27 character names, built from the bottom up so every
+# command's path stays short. Only the deepest is too long for find.
+LEVEL=dddddddddddddddddddddddddd
+for i in 9 8 7 6 5 4 3 2 1 0; do
+    "$FS" -i check.img mkdir_fs /$LEVEL$i >/dev/null
+    [ $i -lt 9 ] && "$FS" -i check.img rename_fs /$LEVEL$(( i + 1 )) /$LEVEL$i/$LEVEL$(( i + 1 )) >/dev/null
+done
+run find / '*[059]'
+run du /
+run rmtree /${LEVEL}0
+run fsck
+
+echo "== checksum mismatch"
+run mkfs -c
+run create_fs /f
+run write_fs /f checksummed
+poke $(( $(block $(peek $(entry $ROOT_BLOCK 0))) * BS )) 1650553701
+run read_fs /f
+run fsck
+run fsck -r
+run read_fs /f
+run fsck
+
+echo "== free counters and usage"
+run mkfs
+run df
+run mkdir_fs /u
+run mkdir_fs /u/v
+run create_fs /u/v/f
+run write_fs /u/v/f counted
+run create_fs /u/g
+run write_fs /u/g more
+run df
+run usage /u
+run usage /u/v
+run write_fs /u/v/f longer
+run rename_fs /u/v/f /f
+run usage /u
+run usage
+run delete_fs /u/g
+run rmdir_fs /u/v
+run df
+run usage /u
+run fsck
+
+echo "== incremental backup"
+run mkfs
+run mkdir_fs /inc
+run create_fs /inc/f
+run write_fs /inc/f base
+run export-incremental --since 0 full.patch
+run apply full.patch replica.img
+run write_fs /inc/f changed
+run diff --since 1
+run export-incremental --since 1 next.patch
+run apply next.patch replica.img
+run apply next.patch fresh.img
+echo "\$ -i replica.img read_fs /inc/f"
+"$FS" -i replica.img read_fs /inc/f 2>&1
+echo "\$ -i replica.img fsck"
+"$FS" -i replica.img fsck 2>&1
+# A copy keeps the generation table, so backups can continue from it
+run copyimg copy.img
+run diff --since 1
+echo "\$ -i copy.img diff --since 1"
+"$FS" -i copy.img diff --since 1 2>&1
+
+echo "== striping"
+IMG=stripe.img
+run mkfs -s 3 2
+run mkdir_fs /s
+run create_fs /s/f
+run write_fs /s/f striped
+run read_fs /s/f
+run ls_fs -l /s
+run fsck
+ls stripe.img*
+IMG=check.img
+
+echo "== daemon with writeback on"
+run mkfs
+echo "\$ -w on serve check.sock 2"
+"$FS" -i check.img -w on serve check.sock 2 >/dev/null 2>&1 &
+SERVER=$!
+i=0
+while [ ! -S check.sock ] && [ $i -lt 50 ]; do sleep 0.1; i=$(( i + 1 )); done
+echo "\$ loadgen check.sock 4 200 8"
+"$FS" loadgen check.sock 4 200 8 2>&1 | grep '^Requests'
+kill -TERM $SERVER
+wait $SERVER
+echo "server exited with $?"
+run df
+run fsck
+
+echo "== direct I/O"
+run mkfs
+echo "\$ -o direct create_fs, write_fs and read_fs /f"
+"$FS" -i check.img -o direct create_fs /f 2>&1
+"$FS" -i check.img -o direct write_fs /f direct 2>&1
+"$FS" -i check.img -o direct read_fs /f 2>&1
+run fsck
+
+cd .. && rm -rf scratch
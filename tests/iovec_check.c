@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "../fs.h"
+
+// Edge cases of readv_fs and writev_fs, run by make check against a scratch
+// image named on the command line
+
+#define MANY (BDEV_IOV_MAX - 1)
+
+static char pieces[BDEV_IOV_MAX][4];
+static struct iovec iov[BDEV_IOV_MAX];
+static char flat[BLOCK_SIZE * 4];
+
+// iovcnt buffers of len bytes each over pieces
+static void splitPieces(int iovcnt, size_t len) {
+    for (int i = 0; i < iovcnt; i++) {
+        iov[i].iov_base = pieces[i];
+        iov[i].iov_len = len;
+    }
+}
+
+static void fillPieces(void) {
+    for (int i = 0; i < BDEV_IOV_MAX; i++)
+        for (int j = 0; j < 4; j++) pieces[i][j] = 'a' + (i * 4 + j) % 26;
+}
+
+static int checkPieces(int count) {
+    for (int i = 0; i < count; i++)
+        for (int j = 0; j < 4; j++)
+            if (pieces[i][j] != 'a' + (i * 4 + j) % 26) return -1;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <image>\n", argv[0]);
+        return 1;
+    }
+    fs_set_image(argv[1]);
+    mkfs(fs_image());
+    create_fs("/v");
+
+    // The most buffers a transfer takes, spanning every block of the file
+    fillPieces();
+    splitPieces(MANY, 4);
+    printf("writev %d buffers: %d\n", MANY, writev_fs("/v", iov, MANY));
+    memset(pieces, 0, sizeof(pieces));
+    printf("readv %d buffers: %d\n", MANY, readv_fs("/v", iov, MANY));
+    printf("contents %s\n", checkPieces(MANY) == 0 ? "match" : "differ");
+
+    // One buffer more is refused before touching the file
+    splitPieces(BDEV_IOV_MAX, 4);
+    printf("writev %d buffers: %d\n", BDEV_IOV_MAX, writev_fs("/v", iov, BDEV_IOV_MAX));
+    printf("readv %d buffers: %d\n", BDEV_IOV_MAX, readv_fs("/v", iov, BDEV_IOV_MAX));
+    printf("size after refusal: %d\n", read_fs("/v", flat, sizeof(flat)));
+
+    // Empty buffers between the others are skipped
+    fillPieces();
+    splitPieces(MANY, 4);
+    for (int i = 0; i < MANY; i += 2) iov[i].iov_len = 0;
+    printf("writev with empty buffers: %d\n", writev_fs("/v", iov, MANY));
+    int bytes = read_fs("/v", flat, sizeof(flat));
+    int same = bytes == (MANY / 2) * 4;
+    for (int i = 1, off = 0; same && i < MANY; i += 2, off += 4) same = memcmp(flat + off, pieces[i], 4) == 0;
+    printf("read back %d bytes, contents %s\n", bytes, same ? "match" : "differ");
+
+    // Buffers larger than the file are filled up to its size only
+    static char big[3][BLOCK_SIZE];
+    memset(big, '#', sizeof(big));
+    struct iovec tail[3] = { { big[0], BLOCK_SIZE }, { big[1], BLOCK_SIZE }, { big[2], BLOCK_SIZE } };
+    write_fs("/v", "partial tail");
+    bytes = readv_fs("/v", tail, 3);
+    printf("readv into %d bytes: %d \"%.*s\", next byte %s\n", 3 * BLOCK_SIZE, bytes,
+           bytes, big[0], big[0][bytes] == '#' ? "untouched" : "overwritten");
+
+    // Writing no buffers at all truncates the file, reading into none is refused
+    printf("writev 0 buffers: %d\n", writev_fs("/v", NULL, 0));
+    printf("readv 0 buffers: %d\n", readv_fs("/v", tail, 0));
+    printf("size after truncation: %d\n", readv_fs("/v", tail, 3));
+
+    remove(argv[1]);
+    return 0;
+}
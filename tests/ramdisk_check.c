@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "../fs.h"
+
+// Runs the file system on a RAM disk, saves it to the image named on the
+// command line and loads it back into a second RAM disk. Run by make check.
+
+static void listDir(const char *path) {
+    DirectoryEntry entries[8];
+    int count = ls_fs(path, entries, 8);
+    printf("ls %s:", path);
+    for (int i = 0; i < count; i++) printf(" %s", entries[i].name);
+    printf("\n");
+}
+
+static void readFile(const char *path) {
+    char buf[BLOCK_SIZE * 4] = {0};
+    int bytes = read_fs(path, buf, sizeof(buf) - 1);
+    printf("read %s: %d \"%s\"\n", path, bytes, bytes > 0 ? buf : "");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <image>\n", argv[0]);
+        return 1;
+    }
+    unlink(argv[1]);
+    fs_set_image(argv[1]);
+
+    BlockDevice *ram = bdev_open_ram(NUM_BLOCKS + GEN_BLOCKS);
+    if (!ram || mkfs_dev(ram) != 0 || mount_dev(ram) != 0) {
+        fprintf(stderr, "Error: Could not set up the RAM disk.\n");
+        return 1;
+    }
+    printf("mkdir /r: %d\n", mkdir_fs("/r"));
+    printf("create /r/f: %d\n", create_fs("/r/f"));
+    printf("write /r/f: %d\n", write_fs("/r/f", "kept in memory"));
+    printf("rename /r/f /r/g: %d\n", rename_fs("/r/f", "/r/g"));
+    printf("create /gone: %d\n", create_fs("/gone"));
+    printf("delete /gone: %d\n", delete_fs("/gone"));
+    listDir("/r");
+    readFile("/r/g");
+    StatFs st;
+    if (statfs_fs(&st) == 0) printf("free blocks %d, free inodes %d\n", st.free_blocks, st.free_inodes);
+    unmount_fs();
+
+    // Nothing reached the file until the RAM disk is saved
+    printf("image written before save: %s\n", access(argv[1], F_OK) == 0 ? "yes" : "no");
+    printf("save: %d\n", bdev_save(ram, argv[1]));
+    bdev_close(ram);
+
+    FsckReport report;
+    printf("fsck of the saved image: %d problems\n", fsck_fs(argv[1], 0, 1, &report));
+
+    BlockDevice *loaded = bdev_load_ram(argv[1]);
+    if (!loaded || mount_dev(loaded) != 0) {
+        fprintf(stderr, "Error: Could not load the RAM disk.\n");
+        return 1;
+    }
+    listDir("/r");
+    readFile("/r/g");
+    unmount_fs();
+    bdev_close(loaded);
+
+    unlink(argv[1]);
+    return 0;
+}
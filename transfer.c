@@ -0,0 +1,724 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fs.h"
+#include "disk.h"
+
+#define INODE_TABLE_BLOCKS ((NUM_INODES * sizeof(Inode) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+// Everything import keeps in memory until the final flush. The bitmap and the
+// inode table are written once at the end, so nothing imported becomes
+// visible, or leaks, if the import stops half way.
+typedef struct {
+    BlockDevice *dev;
+    uint8_t bitmap[BLOCK_SIZE];
+    Inode inodes[INODE_TABLE_BLOCKS * BLOCK_SIZE / sizeof(Inode)];
+    DirUsage usage[USAGE_PER_BLOCK];
+    int nextBlock; // Next-fit cursor so new blocks are laid out sequentially
+    int nextInode;
+    int imported;
+    int usedBlocks;
+    int usedInodes;
+} ImportState;
+
+// A directory being filled, its blocks are written once when it is complete
+typedef struct DirBuild {
+    int inode;
+    struct DirBuild *parent; // NULL for the destination directory
+    DirectoryEntry entries[4][MAX_DIR_ENTRIES];
+} DirBuild;
+
+static int importAllocBlock(ImportState *st) {
+    for (int n = 0; n < NUM_BLOCKS - DATA_START_BLOCK; n++) {
+        int blk = st->nextBlock + n;
+        if (blk >= NUM_BLOCKS) blk -= NUM_BLOCKS - DATA_START_BLOCK;
+        if (!bitmapTest(st->bitmap, blk)) {
+            bitmapSet(st->bitmap, blk);
+            st->nextBlock = blk + 1 < NUM_BLOCKS ? blk + 1 : DATA_START_BLOCK;
+            st->usedBlocks++;
+            return blk;
+        }
+    }
+    return -1;
+}
+
+static int importAllocInode(ImportState *st) {
+    for (int i = st->nextInode; i < NUM_INODES; i++) {
+        if (!st->inodes[i].is_valid) {
+            memset(&st->inodes[i], 0, sizeof(Inode));
+            st->inodes[i].is_valid = 1;
+            st->inodes[i].owner_id = 150240719;
+            for (int s = 0; s < 4; s++) st->inodes[i].direct_blocks[s] = -1;
+            st->nextInode = i + 1;
+            st->usedInodes++;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Only the slots of blocks the directory already has hold entries, the rest
+// of a DirBuild is uninitialized until dirBuildAdd allocates the block
+static int dirBuildHas(const ImportState *st, const DirBuild *db, const char *name) {
+    const Inode *dir = &st->inodes[db->inode];
+    for (int s = 0; s < 4; s++) {
+        if (dir->direct_blocks[s] == -1) continue;
+        for (int j = 0; j < MAX_DIR_ENTRIES; j++) {
+            const DirectoryEntry *e = &db->entries[s][j];
+            if (e->inode_number != -1 && strncmp(e->name, name, sizeof(e->name)) == 0) return 1;
+        }
+    }
+    return 0;
+}
+
+// Adds an entry to a directory under construction, allocating its next block if needed
+static int dirBuildAdd(ImportState *st, DirBuild *db, const char *name, int inode_index) {
+    Inode *dir = &st->inodes[db->inode];
+    for (int s = 0; s < 4; s++) {
+        if (dir->direct_blocks[s] == -1) {
+            int blk = importAllocBlock(st);
+            if (blk == -1) return -1;
+            dir->direct_blocks[s] = blk;
+            memset(db->entries[s], 0xFF, sizeof(db->entries[s]));
+        }
+        for (int j = 0; j < MAX_DIR_ENTRIES; j++) {
+            if (db->entries[s][j].inode_number == -1) {
+                strncpy(db->entries[s][j].name, name, 27);
+                db->entries[s][j].name[27] = '\0';
+                db->entries[s][j].inode_number = inode_index;
+                dir->size++;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+static int dirBuildFlush(ImportState *st, const DirBuild *db) {
+    const Inode *dir = &st->inodes[db->inode];
+    for (int s = 0; s < 4; s++) {
+        if (dir->direct_blocks[s] == -1) continue;
+        if (writeBlock(st->dev, dir->direct_blocks[s], db->entries[s]) != 0) return -1;
+    }
+    return 0;
+}
+
+// Adds a new file or directory to the usage of the directories being built
+static void importCharge(ImportState *st, const DirBuild *db, int bytes) {
+    for (; db; db = db->parent) {
+        st->usage[db->inode].bytes += bytes;
+        st->usage[db->inode].inodes++;
+    }
+}
+
+static int importFile(ImportState *st, const char *hostpath, DirBuild *parent, const char *name) {
+    FILE *in = fopen(hostpath, "rb");
+    if (!in) {
+        fprintf(stderr, "Warning: Skipping %s, cannot open it.\n", hostpath);
+        return 0;
+    }
+
+    // Read the whole file with one call, files are at most 4 blocks
+    char data[BLOCK_SIZE * 4 + 1] = {0};
+    size_t len = fread(data, 1, sizeof(data), in);
+    fclose(in);
+    if (len > BLOCK_SIZE * 4) {
+        fprintf(stderr, "Warning: Skipping %s, file too large.\n", hostpath);
+        return 0;
+    }
+
+    int ino = importAllocInode(st);
+    if (ino == -1) {
+        fprintf(stderr, "Error: No free inodes available.\n");
+        return -1;
+    }
+
+    // Allocate all blocks up front, then write each contiguous run at once
+    Inode *inode = &st->inodes[ino];
+    int nblocks = (int)((len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    for (int b = 0; b < nblocks; b++) {
+        inode->direct_blocks[b] = importAllocBlock(st);
+        if (inode->direct_blocks[b] == -1) {
+            fprintf(stderr, "Error: No space to allocate data blocks.\n");
+            return -1;
+        }
+    }
+    for (int b = 0; b < nblocks;) {
+        int run = 1;
+        while (b + run < nblocks && inode->direct_blocks[b + run] == inode->direct_blocks[b] + run) run++;
+        if (writeBlocks(st->dev, inode->direct_blocks[b], data + b * BLOCK_SIZE, run) != 0) {
+            fprintf(stderr, "Error: Failed to write data blocks.\n");
+            return -1;
+        }
+        b += run;
+    }
+    inode->size = (int)len;
+
+    if (dirBuildAdd(st, parent, name, ino) != 0) {
+        fprintf(stderr, "Error: Directory is full, cannot add %s.\n", name);
+        return -1;
+    }
+    importCharge(st, parent, (int)len);
+    st->imported++;
+    return 0;
+}
+
+static int importDir(ImportState *st, const char *hostpath, DirBuild *db) {
+    DIR *dir = opendir(hostpath);
+    if (!dir) {
+        fprintf(stderr, "Error: Cannot open host directory %s.\n", hostpath);
+        return -1;
+    }
+
+    int rc = 0;
+    struct dirent *de;
+    while (rc == 0 && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", hostpath, de->d_name);
+
+        if (strlen(de->d_name) > 27) {
+            fprintf(stderr, "Warning: Skipping %s, name too long.\n", child);
+            continue;
+        }
+        if (dirBuildHas(st, db, de->d_name)) {
+            fprintf(stderr, "Warning: Skipping %s, already exists.\n", child);
+            continue;
+        }
+
+        struct stat stbuf;
+        if (lstat(child, &stbuf) != 0) continue;
+
+        if (S_ISREG(stbuf.st_mode)) {
+            rc = importFile(st, child, db, de->d_name);
+        } else if (S_ISDIR(stbuf.st_mode)) {
+            int ino = importAllocInode(st);
+            if (ino == -1) {
+                fprintf(stderr, "Error: No free inodes available.\n");
+                rc = -1;
+                break;
+            }
+            st->inodes[ino].is_directory = 1;
+
+            DirBuild *sub = malloc(sizeof(DirBuild));
+            if (!sub) {
+                rc = -1;
+                break;
+            }
+            sub->inode = ino;
+            sub->parent = db;
+            memset(&st->usage[ino], 0, sizeof(DirUsage));
+
+            // Same "." and ".." entries that mkdir_fs writes
+            Inode *subInode = &st->inodes[ino];
+            subInode->direct_blocks[0] = importAllocBlock(st);
+            if (subInode->direct_blocks[0] == -1) {
+                fprintf(stderr, "Error: No free data blocks available.\n");
+                free(sub);
+                rc = -1;
+                break;
+            }
+            memset(sub->entries[0], 0, sizeof(sub->entries[0]));
+            for (int j = 0; j < MAX_DIR_ENTRIES; j++) sub->entries[0][j].inode_number = -1;
+            strncpy(sub->entries[0][0].name, ".", 2);
+            sub->entries[0][0].inode_number = ino;
+            strncpy(sub->entries[0][1].name, "..", 3);
+            sub->entries[0][1].inode_number = db->inode;
+
+            rc = importDir(st, child, sub);
+            if (rc == 0) rc = dirBuildFlush(st, sub);
+            if (rc == 0) rc = dirBuildAdd(st, db, de->d_name, ino);
+            if (rc == 0) importCharge(st, db, 0);
+            if (rc == 0) st->imported++;
+            free(sub);
+        } else {
+            fprintf(stderr, "Warning: Skipping %s, not a regular file or directory.\n", child);
+        }
+    }
+
+    closedir(dir);
+    return rc;
+}
+
+int import_fs(const char *hostdir, const char *path) {
+    // Ensure path exists and is absolute
+    if (!hostdir || !path || path[0] != '/') {
+        fprintf(stderr, "Error: Only absolute paths are supported.\n");
+        return -1;
+    }
+
+    // Open the disk image file
+    BlockDevice *dev = openDisk(DISK_RDWR);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    ImportState *st = calloc(1, sizeof(ImportState));
+    DirBuild *top = malloc(sizeof(DirBuild));
+    if (!st || !top) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        free(st);
+        free(top);
+        closeDisk(dev);
+        return -1;
+    }
+    st->dev = dev;
+    st->nextBlock = DATA_START_BLOCK;
+
+    // Load the bitmap, the whole inode table and the usage table once
+    int rc = readBlock(dev, BITMAP_BLOCK, st->bitmap);
+    for (int b = 0; rc == 0 && b < (int)INODE_TABLE_BLOCKS; b++) {
+        rc = readBlock(dev, INODE_START_BLOCK + b, (char *)st->inodes + b * BLOCK_SIZE);
+    }
+    if (rc == 0) rc = readBlock(dev, USAGE_BLOCK, st->usage);
+
+    // The destination directory must already exist, its blocks are loaded so
+    // new entries go into the existing free slots
+    int dirInodeIndex = (rc == 0) ? resolvePath(dev, path, NULL, NULL) : -1;
+    if (dirInodeIndex == -1 || !st->inodes[dirInodeIndex].is_directory) {
+        fprintf(stderr, "Error: Destination directory not found.\n");
+        free(st);
+        free(top);
+        closeDisk(dev);
+        return -1;
+    }
+    top->inode = dirInodeIndex;
+    top->parent = NULL;
+    DirUsage before = st->usage[dirInodeIndex];
+    for (int s = 0; s < 4; s++) {
+        int blk = st->inodes[dirInodeIndex].direct_blocks[s];
+        if (blk == -1) continue;
+        if (readBlock(dev, blk, top->entries[s]) != 0) rc = -1;
+    }
+
+    if (rc == 0) rc = importDir(st, hostdir, top);
+
+    // Publish the import: inode table, bitmap, then the destination directory
+    // whose entries link the new tree in
+    for (int b = 0; rc == 0 && b < (int)INODE_TABLE_BLOCKS; b++) {
+        rc = writeBlock(dev, INODE_START_BLOCK + b, (char *)st->inodes + b * BLOCK_SIZE);
+    }
+    if (rc == 0) rc = writeBlock(dev, BITMAP_BLOCK, st->bitmap);
+    if (rc == 0) rc = dirBuildFlush(st, top);
+
+    // Then account for it: usage inside the new tree, the directories above
+    // the destination, and the free counters
+    if (rc == 0) rc = writeBlock(dev, USAGE_BLOCK, st->usage);
+    int above = (rc == 0 && dirInodeIndex != 0) ? findDirEntry(dev, dirInodeIndex, "..") : -1;
+    if (above != -1) {
+        rc = chargeUsage(dev, above, st->usage[dirInodeIndex].bytes - before.bytes,
+                         st->usage[dirInodeIndex].inodes - before.inodes);
+    }
+    if (rc == 0) countFree(-st->usedBlocks, -st->usedInodes);
+
+    int imported = st->imported;
+    free(st);
+    free(top);
+    closeDisk(dev);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Import failed, nothing was imported.\n");
+        return -1;
+    }
+    return imported;
+}
+
+// Writes a host file block by block, leaving all-zero blocks as holes
+static int writeHostFile(const char *hostpath, const char *data, int size) {
+    int fd = open(hostpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    int rc = 0;
+    for (int off = 0; rc == 0 && off < size; off += BLOCK_SIZE) {
+        int len = size - off < BLOCK_SIZE ? size - off : BLOCK_SIZE;
+        if (bdev_is_zero(data + off, len)) continue;
+        if (pwrite(fd, data + off, len, off) != len) rc = -1;
+    }
+    if (rc == 0 && ftruncate(fd, size) != 0) rc = -1;
+    close(fd);
+    return rc;
+}
+
+static int exportDir(BlockDevice *dev, int dir_inode_index, const char *hostpath) {
+    if (mkdir(hostpath, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create host directory %s.\n", hostpath);
+        return -1;
+    }
+
+    Inode dirInode;
+    if (readInode(dev, dir_inode_index, &dirInode) != 0) return -1;
+
+    int exported = 0;
+    DirectoryEntry entries[MAX_DIR_ENTRIES];
+    for (int s = 0; s < 4; s++) {
+        if (dirInode.direct_blocks[s] == -1) continue;
+        if (readBlock(dev, dirInode.direct_blocks[s], entries) != 0) return -1;
+
+        for (int j = 0; j < MAX_DIR_ENTRIES; j++) {
+            if (entries[j].inode_number == -1 ||
+                strcmp(entries[j].name, ".") == 0 ||
+                strcmp(entries[j].name, "..") == 0) continue;
+
+            char child[4096];
+            snprintf(child, sizeof(child), "%s/%s", hostpath, entries[j].name);
+
+            Inode inode;
+            if (readInode(dev, entries[j].inode_number, &inode) != 0) return -1;
+
+            if (inode.is_directory) {
+                int n = exportDir(dev, entries[j].inode_number, child);
+                if (n < 0) return -1;
+                exported += n + 1;
+                continue;
+            }
+
+            // Read each contiguous run of blocks with one call and write the
+            // file out with one call
+            char data[BLOCK_SIZE * 4];
+            int b = 0;
+            while (b < 4 && inode.direct_blocks[b] != -1) {
+                int run = 1;
+                while (b + run < 4 && inode.direct_blocks[b + run] == inode.direct_blocks[b] + run) run++;
+                if (readBlocks(dev, inode.direct_blocks[b], data + b * BLOCK_SIZE, run) != 0) return -1;
+                b += run;
+            }
+
+            // A corrupt size must not read past the blocks just loaded
+            int size = inode.size < 0 ? 0 : inode.size;
+            if (size > b * BLOCK_SIZE) size = b * BLOCK_SIZE;
+            if (writeHostFile(child, data, size) != 0) {
+                fprintf(stderr, "Error: Cannot write host file %s.\n", child);
+                return -1;
+            }
+            exported++;
+        }
+    }
+    return exported;
+}
+
+int export_fs(const char *path, const char *hostdir) {
+    // Ensure path exists and is absolute
+    if (!path || path[0] != '/' || !hostdir) {
+        fprintf(stderr, "Error: Only absolute paths are supported.\n");
+        return -1;
+    }
+
+    // Open the disk image file for reading
+    BlockDevice *dev = openDisk(DISK_RDONLY);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    Inode dirInode;
+    int dirInodeIndex = resolvePath(dev, path, NULL, NULL);
+    if (dirInodeIndex == -1 || readInode(dev, dirInodeIndex, &dirInode) != 0 || !dirInode.is_directory) {
+        fprintf(stderr, "Error: Directory not found.\n");
+        closeDisk(dev);
+        return -1;
+    }
+
+    int exported = exportDir(dev, dirInodeIndex, hostdir);
+    closeDisk(dev);
+    return exported;
+}
+
+int copyimage_fs(const char *dst) {
+    if (!dst) {
+        fprintf(stderr, "Error: Invalid arguments to copyimage_fs.\n");
+        return -1;
+    }
+
+    // Open the disk image file for reading
+    BlockDevice *dev = openDisk(DISK_RDONLY);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    uint8_t bitmap[BLOCK_SIZE];
+    BlockDevice *out = bdev_open_file(dst, 1, 1);
+    char *buf = bdev_buf_get();
+    if (!out || !buf || readBlock(dev, BITMAP_BLOCK, bitmap) != 0) {
+        fprintf(stderr, "Error: Could not create %s.\n", dst);
+        bdev_buf_put(buf);
+        bdev_close(out);
+        closeDisk(dev);
+        return -1;
+    }
+
+    // The new image is one big hole, so only metadata and the runs of blocks
+    // marked in the bitmap are written, and all-zero runs are skipped too
+    int copied = 0;
+    int rc = 0;
+    for (int b = 0; rc == 0 && b < NUM_BLOCKS;) {
+        int run = 0;
+        while (b + run < NUM_BLOCKS && run < BDEV_BUF_BLOCKS &&
+               (b + run < DATA_START_BLOCK || bitmapTest(bitmap, b + run))) run++;
+        if (run == 0) {
+            b++;
+            continue;
+        }
+        rc = readBlocks(dev, b, buf, run);
+        if (rc == 0 && !bdev_is_zero(buf, (size_t)run * BLOCK_SIZE)) {
+            rc = out->write(out, b, run, buf);
+            copied += run;
+        }
+        b += run;
+    }
+
+    // The copy keeps the superblock's generation, so it needs the table
+    // stamped with it as well or incremental backups of it would miss blocks
+    SuperBlock sb;
+    if (rc == 0) rc = readBlock(dev, 0, buf);
+    memcpy(&sb, buf, sizeof(sb));
+    for (int g = 0; rc == 0 && (sb.features & FS_FEATURE_CBT) && g < (int)GEN_BLOCKS;) {
+        int run = (int)GEN_BLOCKS - g < BDEV_BUF_BLOCKS ? (int)GEN_BLOCKS - g : BDEV_BUF_BLOCKS;
+        rc = dev->read(dev, GEN_START_BLOCK + g, run, buf);
+        if (rc == 0 && !bdev_is_zero(buf, (size_t)run * BLOCK_SIZE)) {
+            rc = out->write(out, GEN_START_BLOCK + g, run, buf);
+            copied += run;
+        }
+        g += run;
+    }
+    if (rc == 0) rc = out->sync(out);
+
+    bdev_buf_put(buf);
+    bdev_close(out);
+    closeDisk(dev);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Failed to copy disk image.\n");
+        return -1;
+    }
+    return copied;
+}
+
+// Incremental backups. A patch file is a PatchHeader followed by a PatchRecord
+// and the block's contents for every block changed in the range it covers.
+#define PATCH_MAGIC 0x4D465349 // "MFSI"
+
+typedef struct {
+    int magic;
+    int since; // Covers blocks written after this generation
+    int through; // up to and including this one
+    int count; // Records that follow
+} PatchHeader;
+
+typedef struct {
+    int block;
+    int generation; // Generation that last wrote the block
+} PatchRecord;
+
+// Reads the superblock and the generation table, failing on images that do
+// not track changed blocks
+static int loadGenerations(BlockDevice *dev, SuperBlock *sb, uint32_t *gens) {
+    char block[BLOCK_SIZE];
+    if (readBlock(dev, 0, block) != 0) {
+        fprintf(stderr, "Error: Failed to read superblock.\n");
+        return -1;
+    }
+    memcpy(sb, block, sizeof(SuperBlock));
+    if (!(sb->features & FS_FEATURE_CBT)) {
+        fprintf(stderr, "Error: Disk image does not track changed blocks.\n");
+        return -1;
+    }
+    if (dev->read(dev, GEN_START_BLOCK, GEN_BLOCKS, gens) != 0) {
+        fprintf(stderr, "Error: Failed to read generation table.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int changedblocks_fs(int since, int *blocks, int max_blocks, int *generation) {
+    if (since < 0 || (max_blocks > 0 && !blocks)) {
+        fprintf(stderr, "Error: Invalid arguments to changedblocks_fs.\n");
+        return -1;
+    }
+
+    // Open the disk image file for reading
+    BlockDevice *dev = openDisk(DISK_RDONLY);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    SuperBlock sb;
+    uint32_t gens[GEN_BLOCKS * GENS_PER_BLOCK];
+    if (loadGenerations(dev, &sb, gens) != 0) {
+        closeDisk(dev);
+        return -1;
+    }
+
+    int changed = 0;
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+        if (gens[b] <= (uint32_t)since) continue;
+        if (changed < max_blocks) blocks[changed] = b;
+        changed++;
+    }
+    if (generation) *generation = sb.generation;
+    closeDisk(dev);
+    return changed;
+}
+
+int exportincremental_fs(int since, const char *patchfile, int *generation) {
+    if (since < 0 || !patchfile) {
+        fprintf(stderr, "Error: Invalid arguments to exportincremental_fs.\n");
+        return -1;
+    }
+
+    // Open the disk image file for reading and writing
+    BlockDevice *dev = openDisk(DISK_RDWR);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    SuperBlock sb;
+    uint32_t gens[GEN_BLOCKS * GENS_PER_BLOCK];
+    if (loadGenerations(dev, &sb, gens) != 0) {
+        closeDisk(dev);
+        return -1;
+    }
+    if (since > sb.generation) {
+        fprintf(stderr, "Error: Generation %d has not started yet.\n", since);
+        closeDisk(dev);
+        return -1;
+    }
+
+    PatchHeader hdr = { .magic = PATCH_MAGIC, .since = since, .through = sb.generation, .count = 0 };
+    for (int b = 0; b < NUM_BLOCKS; b++) {
+        if (gens[b] > (uint32_t)since) hdr.count++;
+    }
+
+    FILE *out = fopen(patchfile, "wb");
+    char *buf = bdev_buf_get();
+    if (!out || !buf) {
+        fprintf(stderr, "Error: Could not create %s.\n", patchfile);
+        if (out) fclose(out);
+        bdev_buf_put(buf);
+        closeDisk(dev);
+        return -1;
+    }
+
+    // Only the changed blocks are read, in runs of consecutive ones
+    int ok = fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+    for (int b = 0; ok && b < NUM_BLOCKS;) {
+        int run = 0;
+        while (b + run < NUM_BLOCKS && run < BDEV_BUF_BLOCKS && gens[b + run] > (uint32_t)since) run++;
+        if (run == 0) {
+            b++;
+            continue;
+        }
+        ok = readBlocks(dev, b, buf, run) == 0;
+        for (int i = 0; ok && i < run; i++) {
+            PatchRecord rec = { .block = b + i, .generation = (int)gens[b + i] };
+            ok = fwrite(&rec, sizeof(rec), 1, out) == 1 &&
+                 fwrite(buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE, 1, out) == 1;
+        }
+        b += run;
+    }
+    if (fclose(out) != 0) ok = 0;
+    bdev_buf_put(buf);
+    if (!ok) {
+        fprintf(stderr, "Error: Failed to write %s.\n", patchfile);
+        closeDisk(dev);
+        return -1;
+    }
+
+    // Blocks written from now on belong to the next generation, so the next
+    // backup starts from the one just exported
+    char block[BLOCK_SIZE];
+    int rc = readBlock(dev, 0, block);
+    if (rc == 0) {
+        sb.generation++;
+        memcpy(block, &sb, sizeof(SuperBlock));
+        rc = writeBlock(dev, 0, block);
+    }
+    closeDisk(dev);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Failed to start a new generation.\n");
+        return -1;
+    }
+    if (generation) *generation = hdr.through;
+    return hdr.count;
+}
+
+int applyincremental_fs(const char *patchfile, const char *replica) {
+    if (!patchfile || !replica) {
+        fprintf(stderr, "Error: Invalid arguments to applyincremental_fs.\n");
+        return -1;
+    }
+
+    PatchHeader hdr;
+    FILE *in = fopen(patchfile, "rb");
+    if (!in || fread(&hdr, sizeof(hdr), 1, in) != 1 || hdr.magic != PATCH_MAGIC) {
+        fprintf(stderr, "Error: %s is not an incremental backup.\n", patchfile);
+        if (in) fclose(in);
+        return -1;
+    }
+
+    // A full backup may create the replica, anything else needs one to patch
+    BlockDevice *dev = bdev_open_file(replica, 1, 0);
+    if (!dev && hdr.since == 0) dev = bdev_open_file(replica, 1, 1);
+    if (!dev || dev->num_blocks < NUM_BLOCKS + (int)GEN_BLOCKS) {
+        fprintf(stderr, "Error: Could not open replica %s.\n", replica);
+        bdev_close(dev);
+        fclose(in);
+        return -1;
+    }
+
+    // The replica must already hold every change up to since, and nothing
+    // past through
+    SuperBlock sb;
+    char super[BLOCK_SIZE];
+    uint32_t gens[GEN_BLOCKS * GENS_PER_BLOCK];
+    int rc = dev->read(dev, 0, 1, super);
+    if (rc == 0) rc = dev->read(dev, GEN_START_BLOCK, GEN_BLOCKS, gens);
+    memcpy(&sb, super, sizeof(SuperBlock));
+    int at = sb.magic_number == MAGIC_NUMBER ? sb.generation : 0;
+    if (rc == 0 && (at < hdr.since || at > hdr.through)) {
+        fprintf(stderr, "Error: Replica is at generation %d, the backup covers %d to %d.\n",
+                at, hdr.since, hdr.through);
+        bdev_close(dev);
+        fclose(in);
+        return -1;
+    }
+
+    // The superblock is written last, an interrupted apply leaves the replica
+    // at its old generation and can simply be run again
+    char buf[BLOCK_SIZE];
+    int haveSuper = 0;
+    for (int i = 0; rc == 0 && i < hdr.count; i++) {
+        PatchRecord rec;
+        if (fread(&rec, sizeof(rec), 1, in) != 1 || fread(buf, BLOCK_SIZE, 1, in) != 1 ||
+            rec.block < 0 || rec.block >= NUM_BLOCKS) {
+            rc = -1;
+            break;
+        }
+        gens[rec.block] = rec.generation;
+        if (rec.block == 0) {
+            memcpy(super, buf, BLOCK_SIZE);
+            haveSuper = 1;
+        } else if (!bdev_is_zero(buf, BLOCK_SIZE) || dev->discard(dev, rec.block, 1) != 0) {
+            rc = dev->write(dev, rec.block, 1, buf);
+        }
+    }
+    if (rc == 0) rc = dev->write(dev, GEN_START_BLOCK, GEN_BLOCKS, gens);
+    if (rc == 0 && haveSuper) rc = dev->write(dev, 0, 1, super);
+    if (rc == 0) rc = dev->sync(dev);
+
+    bdev_close(dev);
+    fclose(in);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Failed to apply %s.\n", patchfile);
+        return -1;
+    }
+    return hdr.count;
+}
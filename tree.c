@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include "fs.h"
+#include "disk.h"
+
+#define TREE_MAX_THREADS 16
+#define INODE_TABLE_BLOCKS ((NUM_INODES * sizeof(Inode) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+enum { TREE_RM, TREE_DU, TREE_FIND };
+
+// A directory waiting to be walked
+typedef struct {
+    int inode;
+    char path[TREE_PATH_MAX];
+} TreeTask;
+
+// Each thread pushes and pops subdirectories at the tail of its own deque,
+// idle threads steal from the head of someone else's. Every directory is
+// queued at most once, so a deque never holds more than NUM_INODES tasks.
+typedef struct {
+    pthread_mutex_t lock;
+    int head;
+    int tail;
+    TreeTask tasks[NUM_INODES];
+} TreeDeque;
+
+// State shared by the walker threads. The inode table is loaded once up
+// front and only read during the walk, results are gathered with atomics.
+typedef struct {
+    BlockDevice *dev;
+    int mode;
+    int numThreads;
+    Inode inodes[INODE_TABLE_BLOCKS * BLOCK_SIZE / sizeof(Inode)];
+    atomic_char visited[NUM_INODES];
+    atomic_int pending; // Directories queued or being walked
+    atomic_int failed;
+    TreeDeque deques[TREE_MAX_THREADS];
+
+    // rm: inodes to free, each set by the one thread that reached it
+    uint8_t dead[NUM_INODES];
+
+    // du
+    atomic_int files;
+    atomic_int directories;
+    atomic_int blocks;
+    atomic_long bytes;
+
+    // find
+    const char *pattern;
+    char (*matches)[TREE_PATH_MAX];
+    int maxMatches;
+    atomic_int matchCount;
+} TreeWalk;
+
+typedef struct {
+    TreeWalk *walk;
+    int id;
+} TreeWorker;
+
+static int validBlock(int blk) {
+    return blk >= DATA_START_BLOCK && blk < NUM_BLOCKS;
+}
+
+static void pushTask(TreeWalk *walk, int id, int inode, const char *path) {
+    TreeDeque *dq = &walk->deques[id];
+    atomic_fetch_add(&walk->pending, 1);
+    pthread_mutex_lock(&dq->lock);
+    dq->tasks[dq->tail].inode = inode;
+    snprintf(dq->tasks[dq->tail].path, TREE_PATH_MAX, "%s", path);
+    dq->tail++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+// Takes the newest task of the own deque, or the oldest one of another
+// thread's, which tends to be a large subtree near the top
+static int takeTask(TreeWalk *walk, int id, TreeTask *out) {
+    for (int k = 0; k < walk->numThreads; k++) {
+        TreeDeque *dq = &walk->deques[(id + k) % walk->numThreads];
+        pthread_mutex_lock(&dq->lock);
+        int found = dq->head < dq->tail;
+        if (found) *out = (k == 0) ? dq->tasks[--dq->tail] : dq->tasks[dq->head++];
+        pthread_mutex_unlock(&dq->lock);
+        if (found) return 1;
+    }
+    return 0;
+}
+
+// Accounts for one file or directory the walk has reached, path is NULL if
+// it does not fit in TREE_PATH_MAX
+static void visitNode(TreeWalk *walk, int inode, const char *name, const char *path) {
+    const Inode *node = &walk->inodes[inode];
+
+    switch (walk->mode) {
+    case TREE_RM:
+        walk->dead[inode] = 1;
+        break;
+    case TREE_DU:
+        if (node->is_directory) atomic_fetch_add(&walk->directories, 1);
+        else {
+            atomic_fetch_add(&walk->files, 1);
+            atomic_fetch_add(&walk->bytes, node->size);
+        }
+        for (int s = 0; s < 4; s++) {
+            if (validBlock(node->direct_blocks[s])) atomic_fetch_add(&walk->blocks, 1);
+        }
+        break;
+    case TREE_FIND:
+        if (name && fnmatch(walk->pattern, name, 0) == 0) {
+            if (!path) {
+                fprintf(stderr, "Warning: Skipping match %s, path longer than %d characters.\n", name,
+                        TREE_PATH_MAX - 1);
+                break;
+            }
+            int slot = atomic_fetch_add(&walk->matchCount, 1);
+            if (slot < walk->maxMatches) snprintf(walk->matches[slot], TREE_PATH_MAX, "%s", path);
+        }
+        break;
+    }
+}
+
+// Walks the entries of one directory, visiting files right away and queueing
+// subdirectories for whichever thread gets to them first
+static void walkDir(TreeWalk *walk, int id, const TreeTask *task) {
+    const Inode *dir = &walk->inodes[task->inode];
+    DirectoryEntry entries[MAX_DIR_ENTRIES];
+    char child[TREE_PATH_MAX];
+
+    for (int s = 0; s < 4; s++) {
+        int blk = dir->direct_blocks[s];
+        if (!validBlock(blk)) continue;
+
+        // The block cache is not thread safe, but runWalk wrote back every
+        // dirty block, so the device itself is current and can be read
+        // concurrently
+        if (walk->dev->read(walk->dev, blk, 1, entries) != 0) {
+            atomic_store(&walk->failed, 1);
+            return;
+        }
+
+        for (int j = 0; j < (int)MAX_DIR_ENTRIES; j++) {
+            int target = entries[j].inode_number;
+            if (target < 0 || target >= NUM_INODES || !walk->inodes[target].is_valid) continue;
+            if (strcmp(entries[j].name, ".") == 0 || strcmp(entries[j].name, "..") == 0) continue;
+
+            // A damaged image could link a node twice, walk it only once
+            if (atomic_exchange(&walk->visited[target], 1)) continue;
+
+            // Only find needs the path, rm and du walk on below one that is
+            // too long
+            entries[j].name[27] = '\0';
+            int len = snprintf(child, sizeof(child), "%s/%s", strcmp(task->path, "/") == 0 ? "" : task->path,
+                               entries[j].name);
+            visitNode(walk, target, entries[j].name, len >= 0 && len < (int)sizeof(child) ? child : NULL);
+            if (walk->inodes[target].is_directory) pushTask(walk, id, target, child);
+        }
+    }
+}
+
+static void *treeWorker(void *arg) {
+    TreeWorker *worker = arg;
+    TreeWalk *walk = worker->walk;
+    TreeTask task;
+
+    // Children are queued before their parent is counted as done, so pending
+    // only drops to zero once the whole tree has been walked
+    while (atomic_load(&walk->pending) > 0) {
+        if (takeTask(walk, worker->id, &task)) {
+            walkDir(walk, worker->id, &task);
+            atomic_fetch_sub(&walk->pending, 1);
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// Loads the inode table and walks the tree under path with num_threads
+// threads. Returns the inode path resolved to, or -1.
+static int runWalk(TreeWalk *walk, const char *path, int num_threads, int *parent_inode, char *name) {
+    if (flushCache(walk->dev) != 0 ||
+        readBlocks(walk->dev, INODE_START_BLOCK, walk->inodes, INODE_TABLE_BLOCKS) != 0) {
+        fprintf(stderr, "Error: Failed to read inode table.\n");
+        return -1;
+    }
+
+    int start = resolvePath(walk->dev, path, parent_inode, name);
+    if (start == -1 || !walk->inodes[start].is_valid) {
+        fprintf(stderr, "Error: Path not found.\n");
+        return -1;
+    }
+
+    if (num_threads <= 0) num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > TREE_MAX_THREADS) num_threads = TREE_MAX_THREADS;
+    walk->numThreads = num_threads;
+    for (int t = 0; t < num_threads; t++) pthread_mutex_init(&walk->deques[t].lock, NULL);
+
+    atomic_store(&walk->visited[start], 1);
+    visitNode(walk, start, NULL, path);
+    if (walk->inodes[start].is_directory) pushTask(walk, 0, start, path);
+
+    // The calling thread works as thread 0
+    pthread_t threads[TREE_MAX_THREADS];
+    TreeWorker workers[TREE_MAX_THREADS];
+    int started[TREE_MAX_THREADS] = {0};
+    for (int t = 0; t < num_threads; t++) {
+        workers[t].walk = walk;
+        workers[t].id = t;
+        if (t > 0) started[t] = pthread_create(&threads[t], NULL, treeWorker, &workers[t]) == 0;
+    }
+    treeWorker(&workers[0]);
+    for (int t = 1; t < num_threads; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+    }
+
+    for (int t = 0; t < num_threads; t++) pthread_mutex_destroy(&walk->deques[t].lock);
+    if (atomic_load(&walk->failed)) {
+        fprintf(stderr, "Error: Failed to read directory block.\n");
+        return -1;
+    }
+    return start;
+}
+
+int rmtree_fs(const char *path, int num_threads) {
+    // Check if the path is absolute and not the root
+    if (!path || path[0] != '/') {
+        fprintf(stderr, "Error: Only absolute paths are supported.\n");
+        return -1;
+    }
+    if (strcmp(path, "/") == 0) {
+        fprintf(stderr, "Error: Cannot remove root.\n");
+        return -1;
+    }
+
+    // Open the disk image file for reading and writing
+    BlockDevice *dev = openDisk(DISK_RDWR);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    TreeWalk *walk = calloc(1, sizeof(TreeWalk));
+    if (!walk) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        closeDisk(dev);
+        return -1;
+    }
+    walk->dev = dev;
+    walk->mode = TREE_RM;
+
+    int parentInode = -1;
+    char name[28];
+    if (runWalk(walk, path, num_threads, &parentInode, name) == -1) {
+        free(walk);
+        closeDisk(dev);
+        return -1;
+    }
+
+    // Unlink the tree first, so a crash part way through leaves orphans that
+    // fsck can reclaim rather than entries naming free inodes
+    uint8_t bitmap[BLOCK_SIZE];
+    uint8_t freed[BLOCK_SIZE] = {0};
+    int rc = removeDirEntry(dev, parentInode, name);
+    if (rc == 0) rc = readInode(dev, parentInode, &walk->inodes[parentInode]);
+    if (rc == 0) rc = readBlock(dev, BITMAP_BLOCK, bitmap);
+
+    // Free every inode and block of the tree in memory, then write each
+    // changed inode table block and the bitmap once
+    int removed = 0;
+    int freedBlocks = 0;
+    int bytes = 0;
+    uint8_t dirtyTable[INODE_TABLE_BLOCKS] = {0};
+    for (int i = 0; rc == 0 && i < NUM_INODES; i++) {
+        if (!walk->dead[i]) continue;
+        for (int s = 0; s < 4; s++) {
+            if (!validBlock(walk->inodes[i].direct_blocks[s])) continue;
+            bitmapClear(bitmap, walk->inodes[i].direct_blocks[s]);
+            bitmapSet(freed, walk->inodes[i].direct_blocks[s]);
+            freedBlocks++;
+        }
+        if (!walk->inodes[i].is_directory) bytes += walk->inodes[i].size;
+        memset(&walk->inodes[i], 0, sizeof(Inode));
+        dirtyTable[i * sizeof(Inode) / BLOCK_SIZE] = 1;
+        removed++;
+    }
+    for (int b = 0; rc == 0 && b < (int)INODE_TABLE_BLOCKS; b++) {
+        if (dirtyTable[b]) rc = writeBlock(dev, INODE_START_BLOCK + b, (char *)walk->inodes + b * BLOCK_SIZE);
+    }
+    if (rc == 0) rc = writeBlock(dev, BITMAP_BLOCK, bitmap);
+    if (rc == 0) {
+        countFreedBlocks(freed, freedBlocks);
+        countFree(0, removed);
+        rc = chargeUsage(dev, parentInode, -bytes, -removed);
+    }
+
+    free(walk);
+    closeDisk(dev);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Failed to remove %s.\n", path);
+        return -1;
+    }
+    return removed;
+}
+
+int du_fs(const char *path, int num_threads, DuReport *report) {
+    if (!path || path[0] != '/' || !report) {
+        fprintf(stderr, "Error: Only absolute paths are supported.\n");
+        return -1;
+    }
+
+    // Open the disk image file for reading
+    BlockDevice *dev = openDisk(DISK_RDONLY);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    TreeWalk *walk = calloc(1, sizeof(TreeWalk));
+    if (!walk) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        closeDisk(dev);
+        return -1;
+    }
+    walk->dev = dev;
+    walk->mode = TREE_DU;
+
+    int rc = runWalk(walk, path, num_threads, NULL, NULL) == -1 ? -1 : 0;
+    if (rc == 0) {
+        report->files = atomic_load(&walk->files);
+        report->directories = atomic_load(&walk->directories);
+        report->blocks = atomic_load(&walk->blocks);
+        report->bytes = atomic_load(&walk->bytes);
+    }
+
+    free(walk);
+    closeDisk(dev);
+    return rc;
+}
+
+static int comparePaths(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+int find_fs(const char *path, const char *pattern, char (*matches)[TREE_PATH_MAX], int max_matches, int num_threads) {
+    if (!path || path[0] != '/' || !pattern || (max_matches > 0 && !matches)) {
+        fprintf(stderr, "Error: Invalid arguments to find_fs.\n");
+        return -1;
+    }
+
+    // Open the disk image file for reading
+    BlockDevice *dev = openDisk(DISK_RDONLY);
+    if (!dev) {
+        fprintf(stderr, "Error: Could not open disk image.\n");
+        return -1;
+    }
+
+    TreeWalk *walk = calloc(1, sizeof(TreeWalk));
+    if (!walk) {
+        fprintf(stderr, "Error: Out of memory.\n");
+        closeDisk(dev);
+        return -1;
+    }
+    walk->dev = dev;
+    walk->mode = TREE_FIND;
+    walk->pattern = pattern;
+    walk->matches = matches;
+    walk->maxMatches = max_matches;
+
+    int found = runWalk(walk, path, num_threads, NULL, NULL) == -1 ? -1 : atomic_load(&walk->matchCount);
+
+    // Threads finish in any order, sort so the output is stable
+    if (found > 0) qsort(matches, found < max_matches ? found : max_matches, TREE_PATH_MAX, comparePaths);
+
+    free(walk);
+    closeDisk(dev);
+    return found;
+}